@@ -20,6 +20,9 @@
 #include "utrace.h"
 #include "ucode.h"
 #include "chaos.h"
+#include "sched.h"
+#include "idle.h"
+#include "snapshot.h"
 
 #define CHAOS_CSR_TIMER_INTERRUPT_ENABLE (1 << 0)
 #define CHAOS_CSR_LOOP_BACK (1 << 1)
@@ -114,6 +117,7 @@ chaos_xmit_pkt(void)
 	DEBUG(TRACE_CHAOS, "chaos_xmit_pkt() %d bytes, data len %d\n", chaos_xmit_buffer_ptr * 2, (chaos_xmit_buffer_ptr > 0 ? chaos_xmit_buffer[1] & 0x3f : -1));
 
 	chaos_xmit_buffer_size = chaos_xmit_buffer_ptr;
+	idle_busy = true;
 
 	// Dest is already in the buffer.
 
@@ -171,6 +175,12 @@ chaos_set_addr(int addr)
 	chaos_addr = addr;
 }
 
+int
+chaos_get_fd(void)
+{
+	return chaos_fd;
+}
+
 int
 chaos_get_addr(void)
 {
@@ -490,6 +500,7 @@ chaos_poll(void)
 
 	DEBUG(TRACE_CHAOS, "chaos rx: to %o, my %o\n", dest_addr, chaos_addr);
 
+	idle_busy = true;
 	chaos_rx_pkt();
 
 	return 0;
@@ -517,9 +528,39 @@ chaos_reconnect(void)
 	}
 }
 
+#define CHAOS_POLL_CYCLES 0x10000
+
+static void
+chaos_event(void)
+{
+	chaos_poll();
+	sched_after(SCHED_CHAOS, CHAOS_POLL_CYCLES);
+}
+
+// The connection to the chaosnet bridge is not part of the machine;
+// chaos_init() makes a new one.
+void
+chaos_snapshot(struct snapshot *s)
+{
+	SNAP(s, chaos_csr);
+	SNAP(s, chaos_addr);
+	SNAP(s, chaos_bit_count);
+	SNAP(s, chaos_lost_count);
+	SNAP(s, chaos_xmit_buffer);
+	SNAP(s, chaos_xmit_buffer_size);
+	SNAP(s, chaos_xmit_buffer_ptr);
+	SNAP(s, chaos_rcv_buffer);
+	SNAP(s, chaos_rcv_buffer_ptr);
+	SNAP(s, chaos_rcv_buffer_size);
+	SNAP(s, chaos_rcv_buffer_empty);
+}
+
 int
 chaos_init(void)
 {
+	sched_handler(SCHED_CHAOS, chaos_event);
+	sched_at(SCHED_CHAOS, 0);
+
 	if (chaos_connect_to_server()) {
 		close(chaos_fd);
 		chaos_fd = 0;
@@ -5,6 +5,7 @@ extern int chaos_init(void);
 extern void chaos_reconnect(void);
 extern int chaos_poll(void);
 
+extern int chaos_get_fd(void);
 extern int chaos_get_addr(void);
 extern void chaos_set_addr(int addr);
 extern int chaos_get_csr(void);
@@ -15,4 +16,7 @@ extern int chaos_get_rcv_buffer(void);
 extern void chaos_put_xmit_buffer(int v);
 extern void chaos_xmit_pkt(void);
 
+struct snapshot;
+extern void chaos_snapshot(struct snapshot *s);
+
 #endif
@@ -597,6 +597,80 @@ static int misc_inst_vector[1024];
 static int misc_inst_size = sizeof misc_inst / sizeof misc_inst[0];
 static bool misc_inst_vector_setup = false;
 
+static void
+misc_inst_setup(void)
+{
+	if (misc_inst_vector_setup == true)
+		return;
+
+	for (int i = 0; i < misc_inst_size; i++) {
+		int index;
+
+		if (misc_inst[i].name == NULL)
+			break;
+		index = misc_inst[i].value;
+		misc_inst_vector[index] = i;
+	}
+	misc_inst_vector_setup = true;
+}
+
+// Write the mnemonic of macroinstruction INST, without its operands,
+// to BUF.
+void
+disassemble_opcode(uint32_t inst, char *buf, size_t len)
+{
+	int op;
+	int subop;
+	int adr;
+
+	op = ldb(01104, inst);
+	subop = ldb(01503, inst);
+
+	misc_inst_setup();
+
+	switch (op) {
+	case 00:		// DEST/ADDR
+	case 01:
+	case 02:
+	case 03:
+	case 04:
+	case 05:
+	case 06:
+	case 07:
+	case 010:
+		snprintf(buf, len, "%s", op_names[op]);
+		break;
+	case 011:		// ND1.
+		snprintf(buf, len, "%s", nd1_names[subop]);
+		break;
+	case 012:		// ND2.
+		snprintf(buf, len, "%s", nd2_names[subop]);
+		break;
+	case 013:		// ND3.
+		snprintf(buf, len, "%s", nd3_names[subop]);
+		break;
+	case 014:		// BRANCH.
+		snprintf(buf, len, "%s", branch_names[subop]);
+		break;
+	case 015:		// MISC.
+		adr = inst & 0777;
+		if (misc_inst_vector[adr])
+			snprintf(buf, len, "%s", misc_inst[misc_inst_vector[adr]].name);
+		else
+			snprintf(buf, len, "MISC-%o", adr);
+		break;
+	case 016:		// ND4.
+		if (subop <= 6)
+			snprintf(buf, len, "%s", nd4_names[subop]);
+		else
+			snprintf(buf, len, "UNDEF-ND4-%d", subop);
+		break;
+	default:
+		snprintf(buf, len, "UNDEF-%d", op);
+		break;
+	}
+}
+
 void
 disassemble_instruction(uint32_t fefptr, uint32_t loc, int even, uint32_t inst)
 {
@@ -617,17 +691,7 @@ disassemble_instruction(uint32_t fefptr, uint32_t loc, int even, uint32_t inst)
 
 	printf("%011o%c %06o ", loc, even ? 'e' : 'o', inst);
 
-	if (misc_inst_vector_setup == false) {
-		for (int i = 0; i < misc_inst_size; i++) {
-			int index;
-
-			if (misc_inst[i].name == NULL)
-				break;
-			index = misc_inst[i].value;
-			misc_inst_vector[index] = i;
-		}
-		misc_inst_vector_setup = true;
-	}
+	misc_inst_setup();
 
 	switch (op) {
 	case 00:		// DEST/ADDR
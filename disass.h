@@ -4,6 +4,7 @@
 #include "syms.h"
 
 extern char *uinst_desc(uint64_t u, symtab_t *symtab);
+extern void disassemble_opcode(uint32_t inst, char *buf, size_t len);
 extern void disassemble_instruction(uint32_t fefptr, uint32_t loc, int even, uint32_t inst);
 
 #endif
@@ -11,6 +11,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "usim.h"
 #include "ucfg.h"
@@ -18,21 +20,79 @@
 #include "ucode.h"
 #include "mem.h"
 #include "misc.h"
+#include "sched.h"
+#include "idle.h"
+#include "snapshot.h"
+#include "disk.h"
 
 #include "syms.h"
 
 #define LABEL_LABL 011420440514ULL
 #define LABEL_BLANK 020020020020ULL
 
-#define DISKS_MAX 8
+#define DISK_INTERRUPT_CYCLES 2500
+#define DISK_POLL_CYCLES 0x1000
+
+// Seek model, at about 5 million microcycles per second: one
+// revolution takes 16.7 ms at 3600 RPM, a seek 5 ms plus 20 us per
+// cylinder crossed.
+#define DISK_REV_CYCLES 83333
+#define DISK_SETTLE_CYCLES 25000
+#define DISK_CYL_CYCLES 100
+
+#define DISK_PARTS_MAX 32
+
+// Reads that carry on where the last one ended have the image read
+// ahead, in a window that doubles from DISK_RA_MIN to DISK_RA_MAX
+// blocks while the run lasts.
+#define DISK_RA_MIN 16
+#define DISK_RA_MAX 512
+
+// A partition from the pack label, and the blocks moved to and from it.
+struct disk_part {
+	char name[5];
+	uint32_t start;
+	uint32_t size;
+	uint64_t reads;
+	uint64_t writes;
+};
 
 struct {
+	char *filename;
 	int fd;
 	uint8_t *mm;
 
+	// Copy-on-write delta, if any; MM is then read only.
+	uint8_t *map;
+	uint8_t *delta;
+
+	uint32_t blocks;
+	int pos_cyl;		// Cylinder the heads are over.
+
+	// Readahead: the block after the last read, the window, and the
+	// end of what has been advised so far.
+	uint32_t next_block;
+	uint32_t ra_window;
+	uint32_t ra_end;
+
 	int cyls;
 	int heads;
 	int blocks_per_track;
+
+	int nparts;
+	struct disk_part parts[DISK_PARTS_MAX];
+
+	// Statistics; HEAT has the reads and the writes of each block,
+	// if a heatmap is wanted.
+	uint64_t commands;
+	uint64_t ccws;
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint32_t *heat;
+
+	// One bit per DISK_CHUNK blocks written since the last flush,
+	// with the periodic durability mode.
+	uint8_t *dirty;
 } disks[DISKS_MAX];
 
 static int disk_status = 1;
@@ -47,85 +107,469 @@ static int cur_cyl;
 static int cur_head;
 static int cur_block;
 
-static int disk_interrupt_delay;
+// Delta files hold the blocks written since the base image was last
+// committed.  In host byte order:
+//
+//	char magic[8];		"USIMDLTA"
+//	uint32_t blocks;	blocks in the base image
+//
+// padded to a whole block, then a bitmap of the blocks present,
+// rounded up to whole blocks, then the blocks themselves at
+// BLOCK_NO * BLOCKSZ.  Blocks never written are holes in the file.
+#define DELTA_MAGIC "USIMDLTA"
+
+struct delta_header {
+	char magic[8];
+	uint32_t blocks;
+};
 
-static int
-disk_read(int unit, int block_no, uint32_t *buffer)
+#define BIT_TEST(map, b) ((map)[(b) >> 3] & (1 << ((b) & 7)))
+
+static size_t
+delta_map_size(uint32_t blocks)
+{
+	return ((blocks + 7) / 8 + BLOCKSZ - 1) / BLOCKSZ * BLOCKSZ;
+}
+
+// Map the delta FN for a base image of BLOCKS blocks, creating it if
+// it does not exist.
+static uint8_t *
+delta_open(char *fn, uint32_t blocks)
 {
-	off_t offset;
+	struct delta_header h;
+	struct stat st;
+	uint8_t *mm;
+	size_t len;
+	int fd;
+
+	len = BLOCKSZ + delta_map_size(blocks) + (size_t) blocks * BLOCKSZ;
+
+	fd = open(fn, O_RDWR | O_CREAT | O_BINARY, 0666);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		err(1, "disk: %s", fn);
+
+	if (st.st_size == 0) {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, DELTA_MAGIC, sizeof(h.magic));
+		h.blocks = blocks;
+		if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || ftruncate(fd, len) < 0)
+			err(1, "disk: %s", fn);
+	} else if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+		   memcmp(h.magic, DELTA_MAGIC, sizeof(h.magic)) != 0 ||
+		   h.blocks != blocks || (size_t) st.st_size != len) {
+		errx(1, "disk: %s is not a delta for a %u block image", fn, blocks);
+	}
+
+	mm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mm == MAP_FAILED)
+		err(1, "disk: %s", fn);
+	close(fd);
 
-	unit = 0;		///---!!!
+	return mm;
+}
 
-	offset = block_no * BLOCKSZ;
+// Return block BLOCK_NO of UNIT.  With a delta, written blocks come
+// from the delta, and writes always go there.
+static uint8_t *
+disk_block(int unit, int block_no, bool write)
+{
+	if (disks[unit].map && (write || BIT_TEST(disks[unit].map, block_no)))
+		return disks[unit].delta + (off_t) block_no * BLOCKSZ;
+	return disks[unit].mm + (off_t) block_no * BLOCKSZ;
+}
 
-	DEBUG(TRACE_DISK, "disk: file image block %d(10), offset %ld(10)\n", block_no, (long) offset);
+static int
+disk_read(int unit, int block_no, uint32_t *buffer)
+{
+	DEBUG(TRACE_DISK, "disk: file image block %d(10)\n", block_no);
 
-	memcpy(buffer, disks[unit].mm + offset, BLOCKSZ);
+	memcpy(buffer, disk_block(unit, block_no, false), BLOCKSZ);
 
 	return 0;
 }
 
+// A CCW chain is gathered into a batch of block transfers, which are
+// then copied straight between the disk image and physical memory,
+// either right away or by the worker thread.
+struct disk_xfer {
+	struct page_s *page;
+	int block_no;
+};
+
+static struct disk_xfer *disk_batch;
+static int disk_batch_len;
+static int disk_batch_max;
+static int disk_batch_unit;
+static bool disk_batch_write;
+
+// The worker thread owns the batch while DISK_QUEUED is set.
+static bool disk_threaded;
+static pthread_t disk_thread;
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_cond = PTHREAD_COND_INITIALIZER;
+static bool disk_queued;
+
+// When writes reach stable storage: whenever the kernel gets round to
+// it, every DISK_FLUSH_SECONDS from the flusher thread, or before the
+// command completes.
+enum {
+	DISK_WRITEBACK,
+	DISK_PERIODIC,
+	DISK_WRITETHROUGH,
+};
+
+#define DISK_CHUNK 64
+
+static int disk_durability = DISK_WRITEBACK;
+static unsigned disk_flush_seconds;
+static pthread_t disk_flush_thread;
+static pthread_mutex_t disk_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cycles from the start of a command until its completion interrupt.
+enum {
+	DISK_LATENCY_INSTANT,
+	DISK_LATENCY_FIXED,
+	DISK_LATENCY_SEEK,
+};
+
+static bool disk_preload_flag;
+
+static int disk_latency = DISK_LATENCY_FIXED;
+static size_t disk_latency_cycles = DISK_INTERRUPT_CYCLES;
+
 static int
-disk_write(int unit, int block_no, uint32_t *buffer)
+disk_block_no(int unit, int cyl, int head, int block)
 {
-	off_t offset;
+	return (cyl * disks[unit].blocks_per_track * disks[unit].heads) + (head * disks[unit].blocks_per_track) + block;
+}
 
-	unit = 0;		///---!!!
+static void
+disk_count(int unit, int block_no, bool write)
+{
+	if (write)
+		disks[unit].blocks_written++;
+	else
+		disks[unit].blocks_read++;
+
+	for (int i = 0; i < disks[unit].nparts; i++) {
+		struct disk_part *p;
+
+		p = &disks[unit].parts[i];
+		if ((uint32_t) block_no >= p->start && (uint32_t) block_no - p->start < p->size) {
+			if (write)
+				p->writes++;
+			else
+				p->reads++;
+			break;
+		}
+	}
 
-	offset = block_no * BLOCKSZ;
+	if (disks[unit].heat)
+		disks[unit].heat[2 * block_no + write]++;
+}
 
-	DEBUG(TRACE_DISK, "disk: file image block %d, offset %ld\n", block_no, (long) offset);
+static void
+disk_batch_add(struct page_s *page, int block_no)
+{
+	if (disk_batch_len == disk_batch_max) {
+		disk_batch_max = disk_batch_max ? disk_batch_max * 2 : 64;
+		disk_batch = realloc(disk_batch, disk_batch_max * sizeof(struct disk_xfer));
+		if (disk_batch == NULL)
+			err(1, "disk: batch");
+	}
 
-	memcpy(disks[unit].mm + offset, buffer, BLOCKSZ);
+	disk_batch[disk_batch_len].page = page;
+	disk_batch[disk_batch_len].block_no = block_no;
+	disk_batch_len++;
+}
 
-	return 0;
+// Write blocks FIRST to END-1 of UNIT, wherever they are kept, and the
+// delta bitmap, to stable storage.
+static void
+disk_sync(int unit, uint32_t first, uint32_t end)
+{
+	static uintptr_t pagemask;
+	uint8_t *base;
+	uintptr_t start;
+	uintptr_t stop;
+
+	if (pagemask == 0)
+		pagemask = sysconf(_SC_PAGESIZE) - 1;
+
+	base = disks[unit].map ? disks[unit].delta : disks[unit].mm;
+	start = (uintptr_t) (base + (off_t) first * BLOCKSZ) & ~pagemask;
+	stop = (uintptr_t) (base + (off_t) end * BLOCKSZ);
+	if (msync((void *) start, stop - start, MS_SYNC) < 0)
+		WARNING(TRACE_DISK, "disk: unit %d msync failed\n", unit);
+
+	if (disks[unit].map) {
+		start = (uintptr_t) disks[unit].map & ~pagemask;
+		stop = (uintptr_t) (disks[unit].map + delta_map_size(disks[unit].blocks));
+		if (msync((void *) start, stop - start, MS_SYNC) < 0)
+			WARNING(TRACE_DISK, "disk: unit %d msync failed\n", unit);
+	}
 }
 
+// Write the blocks written since the last flush to stable storage.
+// Runs of dirty chunks are taken off the map under the lock, so a
+// write that races with the flush is caught by the next one.
 static void
-disk_read_block(uint32_t vma, int unit, int cyl, int head, int block)
+disk_flush(void)
 {
-	int block_no;
-	uint32_t buffer[256];
+	for (int unit = 0; unit < DISKS_MAX; unit++) {
+		uint32_t chunks;
+		uint32_t c;
+
+		if (disks[unit].dirty == NULL)
+			continue;
+
+		chunks = (disks[unit].blocks + DISK_CHUNK - 1) / DISK_CHUNK;
+		c = 0;
+		while (c < chunks) {
+			uint32_t e;
+
+			pthread_mutex_lock(&disk_dirty_lock);
+			while (c < chunks && !BIT_TEST(disks[unit].dirty, c))
+				c++;
+			for (e = c; e < chunks && BIT_TEST(disks[unit].dirty, e); e++)
+				disks[unit].dirty[e >> 3] &= ~(1 << (e & 7));
+			pthread_mutex_unlock(&disk_dirty_lock);
+
+			if (c == e)
+				break;
+			DEBUG(TRACE_DISK, "disk: unit %d flush %u-%u\n", unit, c * DISK_CHUNK, e * DISK_CHUNK);
+			disk_sync(unit, c * DISK_CHUNK, e * DISK_CHUNK < disks[unit].blocks ? e * DISK_CHUNK : disks[unit].blocks);
+			c = e;
+		}
+	}
+}
+
+static void *
+disk_flusher(void *arg)
+{
+	(void) arg;
+	for (;;) {
+		sleep(disk_flush_seconds);
+		disk_flush();
+	}
+
+	return NULL;
+}
 
-	block_no = (cyl * disks[unit].blocks_per_track * disks[unit].heads) + (head * disks[unit].blocks_per_track) + block;
-	if (disk_read(unit, block_no, buffer) < 0) {
-		ERR(TRACE_DISK, "disk_read_block: error reading block_no %d\n", block_no);
+static void
+disk_transfer(void)
+{
+	int unit;
+
+	unit = disk_batch_unit;
+
+	for (int i = 0; i < disk_batch_len; i++) {
+		struct disk_xfer *x;
+		uint8_t *blk;
+
+		x = &disk_batch[i];
+		blk = disk_block(unit, x->block_no, disk_batch_write);
+		if (disk_batch_write) {
+			memcpy(blk, x->page->w, BLOCKSZ);
+			if (disks[unit].map)
+				disks[unit].map[x->block_no >> 3] |= 1 << (x->block_no & 7);
+		} else {
+			memcpy(x->page->w, blk, BLOCKSZ);
+		}
+	}
+
+	if (!disk_batch_write || disk_batch_len == 0)
 		return;
+
+	switch (disk_durability) {
+	case DISK_PERIODIC:
+		pthread_mutex_lock(&disk_dirty_lock);
+		for (int i = 0; i < disk_batch_len; i++) {
+			uint32_t c;
+
+			c = disk_batch[i].block_no / DISK_CHUNK;
+			disks[unit].dirty[c >> 3] |= 1 << (c & 7);
+		}
+		pthread_mutex_unlock(&disk_dirty_lock);
+		break;
+	case DISK_WRITETHROUGH:
+		// Sync each run of consecutive blocks.
+		for (int i = 0, j; i < disk_batch_len; i = j) {
+			for (j = i + 1; j < disk_batch_len; j++) {
+				if (disk_batch[j].block_no != disk_batch[j - 1].block_no + 1)
+					break;
+			}
+			disk_sync(unit, disk_batch[i].block_no, disk_batch[j - 1].block_no + 1);
+		}
+		break;
 	}
+}
 
-	for (int i = 0; i < 256; i++) {
-		write_phy_mem(vma + i, buffer[i]);
+static void *
+disk_worker(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&disk_lock);
+	for (;;) {
+		while (!disk_queued)
+			pthread_cond_wait(&disk_cond, &disk_lock);
+		pthread_mutex_unlock(&disk_lock);
+
+		disk_transfer();
+
+		pthread_mutex_lock(&disk_lock);
+		disk_queued = false;
+		pthread_cond_broadcast(&disk_cond);
 	}
+
+	return NULL;
 }
 
 static void
-disk_write_block(uint32_t vma, int unit, int cyl, int head, int block)
+disk_submit(void)
 {
-	int block_no;
-	uint32_t buffer[256];
+	if (!disk_threaded) {
+		disk_transfer();
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	disk_queued = true;
+	pthread_cond_broadcast(&disk_cond);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+static bool
+disk_transfer_done(void)
+{
+	bool done;
+
+	if (!disk_threaded)
+		return true;
 
-	block_no = (cyl * disks[unit].blocks_per_track * disks[unit].heads) + (head * disks[unit].blocks_per_track) + block;
+	pthread_mutex_lock(&disk_lock);
+	done = !disk_queued;
+	pthread_mutex_unlock(&disk_lock);
+
+	return done;
+}
 
-	for (int i = 0; i < 256; i++) {
-		read_phy_mem(vma + i, &buffer[i]);
+// Wait for the transfer in flight, if any, to reach memory and the
+// disk image.
+void
+disk_drain(void)
+{
+	if (!disk_threaded)
+		return;
+
+	pthread_mutex_lock(&disk_lock);
+	while (disk_queued)
+		pthread_cond_wait(&disk_cond, &disk_lock);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+// A command completes once the latency model says so and the
+// transfer is really done; until then the controller is busy.
+static void
+disk_complete(void)
+{
+	if (!disk_transfer_done()) {
+		sched_after(SCHED_DISK, DISK_POLL_CYCLES);
+		return;
+	}
+
+	DEBUG(TRACE_DISK, "disk: done\n");
+	disk_status |= 1;	// Idle.
+
+	if (disk_cmd & 04000) {
+		DEBUG(TRACE_DISK, "disk: throw interrupt\n");
+		disk_status |= 1 << 3;
+		assert_xbus_interrupt();
 	}
+}
 
-	disk_write(unit, block_no, buffer);
+// Seek to CYL, wait for BLOCK to come round, and transfer N blocks.
+static size_t
+disk_seek_cycles(int unit, int cyl, int block, int n)
+{
+	size_t block_cycles;
+	size_t delay;
+	int bpt;
+
+	bpt = disks[unit].blocks_per_track;
+	if (bpt <= 0)
+		bpt = 1;
+	block_cycles = DISK_REV_CYCLES / bpt;
+
+	delay = 0;
+	if (cyl != disks[unit].pos_cyl)
+		delay += DISK_SETTLE_CYCLES + abs(cyl - disks[unit].pos_cyl) * DISK_CYL_CYCLES;
+	delay += ((block - (ucode_cycles() + delay) / block_cycles % bpt + bpt) % bpt) * block_cycles;
+	delay += n * block_cycles;
+
+	return delay;
 }
 
+static size_t
+disk_latency_for(int unit, int cyl, int block, int n)
+{
+	switch (disk_latency) {
+	case DISK_LATENCY_INSTANT:
+		return 0;
+	case DISK_LATENCY_FIXED:
+		return disk_latency_cycles;
+	default:
+		return disk_seek_cycles(unit, cyl, block, n);
+	}
+}
+
+// Ask the kernel to page in blocks FIRST to END-1 of UNIT.
 static void
-disk_throw_interrupt(void)
+disk_willneed(int unit, uint32_t first, uint32_t end)
 {
-	DEBUG(TRACE_DISK, "disk: throw interrupt\n");
-	disk_status |= 1 << 3;
-	assert_xbus_interrupt();
+	static uintptr_t pagemask;
+	uintptr_t start;
+	uintptr_t stop;
+
+	if (pagemask == 0)
+		pagemask = sysconf(_SC_PAGESIZE) - 1;
+
+	if (end > disks[unit].blocks)
+		end = disks[unit].blocks;
+	if (first >= end)
+		return;
+
+	start = (uintptr_t) (disks[unit].mm + (off_t) first * BLOCKSZ) & ~pagemask;
+	stop = (uintptr_t) (disks[unit].mm + (off_t) end * BLOCKSZ);
+	if (madvise((void *) start, stop - start, MADV_WILLNEED) < 0)
+		DEBUG(TRACE_DISK, "disk: madvise failed\n");
 }
 
+// Note a read of blocks FIRST to END-1, and read ahead if it follows
+// on from the previous one.
 static void
-disk_future_interrupt(void)
+disk_readahead(int unit, uint32_t first, uint32_t end)
 {
-	disk_interrupt_delay = 100;
-	disk_interrupt_delay = 2500;
+	if (first != disks[unit].next_block) {
+		disks[unit].ra_window = 0;
+		disks[unit].ra_end = 0;
+		disks[unit].next_block = end;
+		return;
+	}
+	disks[unit].next_block = end;
+
+	if (disks[unit].ra_window == 0)
+		disks[unit].ra_window = DISK_RA_MIN;
+	else if (disks[unit].ra_window < DISK_RA_MAX)
+		disks[unit].ra_window *= 2;
+
+	if (disks[unit].ra_end < end)
+		disks[unit].ra_end = end;
+	if (end + disks[unit].ra_window > disks[unit].ra_end) {
+		DEBUG(TRACE_DISK, "disk: unit %d read ahead %u-%u\n", unit, disks[unit].ra_end, end + disks[unit].ra_window);
+		disk_willneed(unit, disks[unit].ra_end, end + disks[unit].ra_window);
+		disks[unit].ra_end = end + disks[unit].ra_window;
+	}
 }
 
 static void
@@ -156,15 +600,11 @@ disk_undecode_addr(void)
 static void
 disk_incr_block(void)
 {
-	int unit;
-
-	unit = 0;		///---!!!
-
 	cur_block++;
-	if (cur_block >= disks[unit].blocks_per_track) {
+	if (cur_block >= disks[cur_unit].blocks_per_track) {
 		cur_block = 0;
 		cur_head++;
-		if (cur_head >= disks[unit].heads) {
+		if (cur_head >= disks[cur_unit].heads) {
 			cur_head = 0;
 			cur_cyl++;
 		}
@@ -172,12 +612,37 @@ disk_incr_block(void)
 }
 
 static void
-disk_ccw(void (*disk_fn)(uint32_t vma, int unit, int cyl, int head, int block))
+disk_ccw(bool write)
 {
 	uint32_t ccw;
 	uint32_t vma;
+	struct page_s *page;
+	int block_no;
+	int cyl;
+	int block;
+
+	// The controller runs one command at a time.
+	disk_drain();
 
 	disk_decode_addr();
+	cyl = cur_cyl;
+	block = cur_block;
+
+	disk_batch_len = 0;
+	disk_batch_unit = cur_unit;
+	disk_batch_write = write;
+
+	// A unit that is not attached doesn't answer the select: the
+	// command completes at once, with no transfer and No Select set.
+	disk_status &= ~(1 << 5);
+	if (disks[cur_unit].mm == NULL) {
+		ERR(TRACE_DISK, "disk: unit %d is not attached\n", cur_unit);
+		disk_status |= 1 << 5;	// No select.
+		disk_status &= ~1;	// Busy.
+		idle_busy = true;
+		sched_after(SCHED_DISK, 0);
+		return;
+	}
 
 	// Process CCW's.
 	for (int i = 0; i < 65535; i++) {
@@ -187,17 +652,28 @@ disk_ccw(void (*disk_fn)(uint32_t vma, int unit, int cyl, int head, int block))
 		if (f) {
 			// Huh. what to do now?
 			ERR(TRACE_DISK, "disk: mem[clp=%o] yielded fault (no page)\n", disk_clp);
+			disk_transfer();
 			return;
 		}
 
 		DEBUG(TRACE_DISK, "disk: mem[clp=%o] -> ccw %08o\n", disk_clp, ccw);
+		disks[cur_unit].ccws++;
 
 		vma = ccw & ~0377;
 		disk_ma = vma;
 
 		disk_show_cur_addr();
 
-		(*disk_fn)(vma, cur_unit, cur_cyl, cur_head, cur_block);
+		page = phy_page(vma >> 8);
+		block_no = disk_block_no(cur_unit, cur_cyl, cur_head, cur_block);
+		if (page == NULL)
+			ERR(TRACE_DISK, "disk: ccw to nonexistent memory %o\n", vma);
+		else if ((uint32_t) block_no >= disks[cur_unit].blocks)
+			ERR(TRACE_DISK, "disk: block %d(10) is past the end of unit %d\n", block_no, cur_unit);
+		else {
+			disk_batch_add(page, block_no);
+			disk_count(cur_unit, block_no, write);
+		}
 
 		if ((ccw & 1) == 0) {
 			DEBUG(TRACE_DISK, "disk: last ccw\n");
@@ -211,15 +687,21 @@ disk_ccw(void (*disk_fn)(uint32_t vma, int unit, int cyl, int head, int block))
 
 	disk_undecode_addr();
 
-	if (disk_cmd & 04000) {
-		disk_future_interrupt();
-	}
+	if (!write && disk_batch_len > 0)
+		disk_readahead(cur_unit, disk_batch[0].block_no, disk_batch[disk_batch_len - 1].block_no + 1);
+
+	disk_status &= ~1;	// Busy.
+	disk_submit();
+
+	idle_busy = true;
+	sched_after(SCHED_DISK, disk_latency_for(cur_unit, cyl, block, disk_batch_len));
+	disks[cur_unit].pos_cyl = cur_cyl;
 }
 
 static void
 disk_start_read(void)
 {
-	disk_ccw(&disk_read_block);
+	disk_ccw(false);
 }
 
 static void
@@ -233,13 +715,14 @@ disk_start_read_compare(void)
 static void
 disk_start_write(void)
 {
-	disk_ccw(&disk_write_block);
+	disk_ccw(true);
 }
 
 static int
 disk_start(void)
 {
 	DEBUG(TRACE_DISK, "disk: start, cmd (%o) ", disk_cmd);
+	disks[(disk_da >> 28) & 07].commands++;
 
 	switch (disk_cmd & 01777) {
 	case 0:
@@ -268,9 +751,10 @@ disk_start(void)
 	return 0;
 }
 
-void
-disk_xbus_read(int offset, uint32_t *pv)
+static void
+disk_xbus_read(uint32_t vaddr, int offset, uint32_t *pv)
 {
+	(void) vaddr;
 	DEBUG(TRACE_MISC, "disk register read, offset %o\n", offset);
 
 	switch (offset) {
@@ -309,9 +793,10 @@ disk_xbus_read(int offset, uint32_t *pv)
 	}
 }
 
-void
-disk_xbus_write(int offset, uint32_t v)
+static void
+disk_xbus_write(uint32_t vaddr, int offset, uint32_t v)
 {
+	(void) vaddr;
 	DEBUG(TRACE_MISC, "disk register write, offset %o <- %o\n", offset, v);
 
 	switch (offset) {
@@ -341,18 +826,251 @@ disk_xbus_write(int offset, uint32_t v)
 	}
 }
 
+// The pending completion interrupt is kept by the scheduler; the
+// snapshot is only taken with no transfer in flight.
 void
-disk_poll(void)
+disk_snapshot(struct snapshot *s)
+{
+	SNAP(s, disk_status);
+	SNAP(s, disk_cmd);
+	SNAP(s, disk_clp);
+	SNAP(s, disk_ma);
+	SNAP(s, disk_ecc);
+	SNAP(s, disk_da);
+	SNAP(s, cur_unit);
+	SNAP(s, cur_cyl);
+	SNAP(s, cur_head);
+	SNAP(s, cur_block);
+	for (int unit = 0; unit < DISKS_MAX; unit++)
+		SNAP(s, disks[unit].pos_cyl);
+}
+
+static void
+disk_exit(void)
+{
+	disk_drain();
+	if (disk_durability == DISK_PERIODIC)
+		disk_flush();
+}
+
+static void
+disk_setup(void)
+{
+	static bool done;
+	char *end;
+
+	if (done)
+		return;
+	done = true;
+
+	if (streq(ucfg.disk_backend, "thread"))
+		disk_threaded = true;
+	else if (!streq(ucfg.disk_backend, "sync"))
+		errx(1, "disk: backend must be sync or thread: %s", ucfg.disk_backend);
+
+	if (streq(ucfg.disk_latency, "instant"))
+		disk_latency = DISK_LATENCY_INSTANT;
+	else if (streq(ucfg.disk_latency, "fixed"))
+		disk_latency = DISK_LATENCY_FIXED;
+	else if (streq(ucfg.disk_latency, "seek"))
+		disk_latency = DISK_LATENCY_SEEK;
+	else
+		errx(1, "disk: latency must be instant, fixed or seek: %s", ucfg.disk_latency);
+
+	if (streq(ucfg.disk_preload, "yes"))
+		disk_preload_flag = true;
+	else if (!streq(ucfg.disk_preload, "no"))
+		errx(1, "disk: preload must be yes or no: %s", ucfg.disk_preload);
+
+	disk_latency_cycles = strtoul(ucfg.disk_latency_cycles, &end, 0);
+	if (*end != 0)
+		errx(1, "disk: latency cycles must be a number: %s", ucfg.disk_latency_cycles);
+
+	if (disk_threaded) {
+		if (pthread_create(&disk_thread, NULL, disk_worker, NULL) != 0)
+			errx(1, "disk: could not start the worker thread");
+	}
+
+	if (streq(ucfg.disk_durability, "writeback"))
+		disk_durability = DISK_WRITEBACK;
+	else if (streq(ucfg.disk_durability, "periodic"))
+		disk_durability = DISK_PERIODIC;
+	else if (streq(ucfg.disk_durability, "writethrough"))
+		disk_durability = DISK_WRITETHROUGH;
+	else
+		errx(1, "disk: durability must be writeback, periodic or writethrough: %s", ucfg.disk_durability);
+
+	disk_flush_seconds = strtoul(ucfg.disk_flush_seconds, &end, 0);
+	if (*end != 0 || disk_flush_seconds == 0)
+		errx(1, "disk: flush seconds must be a positive number: %s", ucfg.disk_flush_seconds);
+
+	if (disk_durability == DISK_PERIODIC) {
+		if (pthread_create(&disk_flush_thread, NULL, disk_flusher, NULL) != 0)
+			errx(1, "disk: could not start the flusher thread");
+	}
+
+	atexit(disk_exit);
+
+	if (ucfg.disk_stats_filename || ucfg.disk_heatmap_filename)
+		atexit(disk_stats_dump);
+
+	sched_handler(SCHED_DISK, disk_complete);
+	io_register(036777, 0370, 0377, disk_xbus_read, disk_xbus_write);
+}
+
+// The partition table in the pack label has the number of partitions
+// at 0200 and the words per entry at 0201; the entries, from 0202,
+// start with the name, first block and size.
+static void
+disk_label_parts(int unit, uint32_t *label)
+{
+	uint32_t count;
+	uint32_t size;
+	uint32_t p;
+
+	if (label[1] != 1) {
+		WARNING(TRACE_DISK, "disk: unit %d label version not 1, no partitions\n", unit);
+		return;
+	}
+
+	count = label[0200];
+	size = label[0201];
+	if (size < 3)
+		return;
+
+	p = 0202;
+	for (uint32_t i = 0; i < count && i < DISK_PARTS_MAX && p + 2 < 256; i++) {
+		struct disk_part *part;
+
+		part = &disks[unit].parts[disks[unit].nparts++];
+		memcpy(part->name, unstr4(label[p]), sizeof(part->name));
+		part->start = label[p + 1];
+		part->size = label[p + 2];
+		p += size;
+	}
+}
+
+// Read the load band named in the label into the page cache, so that
+// booting does not fault it in a page at a time.
+static void
+disk_preload(int unit, uint32_t *label)
 {
-	if (disk_interrupt_delay) {
-		if (--disk_interrupt_delay == 0) {
-			disk_throw_interrupt();
+	char name[5];
+
+	if (disks[unit].nparts == 0)
+		return;
+	memcpy(name, unstr4(label[7]), sizeof(name));
+
+	for (int i = 0; i < disks[unit].nparts; i++) {
+		struct disk_part *p;
+		uint32_t end;
+		volatile uint8_t sum;
+
+		p = &disks[unit].parts[i];
+		if (!streq(p->name, name))
+			continue;
+
+		end = p->start + p->size;
+		if (end > disks[unit].blocks)
+			end = disks[unit].blocks;
+
+		disk_willneed(unit, p->start, end);
+		sum = 0;
+		for (uint32_t b = p->start; b < end; b++)
+			sum += disks[unit].mm[(off_t) b * BLOCKSZ];
+
+		INFO(TRACE_DISK, "disk: unit %d preloaded %s, %u blocks\n", unit, name, end - p->start);
+		return;
+	}
+
+	WARNING(TRACE_DISK, "disk: unit %d has no partition %s to preload\n", unit, name);
+}
+
+static void
+disk_dump_stats(FILE *f)
+{
+	for (int unit = 0; unit < DISKS_MAX; unit++) {
+		uint64_t reads;
+		uint64_t writes;
+
+		if (disks[unit].mm == NULL)
+			continue;
+
+		fprintf(f, "# unit %d: %s\n", unit, disks[unit].filename);
+		fprintf(f, "commands\t%llu\n", (unsigned long long) disks[unit].commands);
+		fprintf(f, "ccws\t%llu\n", (unsigned long long) disks[unit].ccws);
+		fprintf(f, "blocks read\t%llu\t%llu bytes\n",
+			(unsigned long long) disks[unit].blocks_read,
+			(unsigned long long) disks[unit].blocks_read * BLOCKSZ);
+		fprintf(f, "blocks written\t%llu\t%llu bytes\n",
+			(unsigned long long) disks[unit].blocks_written,
+			(unsigned long long) disks[unit].blocks_written * BLOCKSZ);
+
+		fprintf(f, "# partition\tstart\tsize\treads\twrites\n");
+		reads = disks[unit].blocks_read;
+		writes = disks[unit].blocks_written;
+		for (int i = 0; i < disks[unit].nparts; i++) {
+			struct disk_part *p;
+
+			p = &disks[unit].parts[i];
+			fprintf(f, "%s\t%o\t%o\t%llu\t%llu\n", p->name, p->start, p->size,
+				(unsigned long long) p->reads, (unsigned long long) p->writes);
+			reads -= p->reads;
+			writes -= p->writes;
+		}
+		fprintf(f, "(none)\t\t\t%llu\t%llu\n", (unsigned long long) reads, (unsigned long long) writes);
+	}
+}
+
+// One line per block used: unit, block number, reads and writes.
+static void
+disk_dump_heatmap(FILE *f)
+{
+	fprintf(f, "# unit\tblock\treads\twrites\n");
+	for (int unit = 0; unit < DISKS_MAX; unit++) {
+		if (disks[unit].heat == NULL)
+			continue;
+
+		for (uint32_t b = 0; b < disks[unit].blocks; b++) {
+			uint32_t *h;
+
+			h = &disks[unit].heat[2 * b];
+			if (h[0] || h[1])
+				fprintf(f, "%d\t%u\t%u\t%u\n", unit, b, h[0], h[1]);
 		}
 	}
 }
 
+static void
+disk_dump_file(char *fn, void (*dump)(FILE *))
+{
+	FILE *f;
+
+	f = fopen(fn, "w");
+	if (f == NULL) {
+		warn("disk: %s", fn);
+		return;
+	}
+	dump(f);
+	fclose(f);
+
+	NOTICE(TRACE_DISK, "disk: wrote %s\n", fn);
+}
+
+// Write the statistics and the heatmap, if configured.
+void
+disk_stats_dump(void)
+{
+	if (ucfg.disk_stats_filename)
+		disk_dump_file(ucfg.disk_stats_filename, disk_dump_stats);
+	if (ucfg.disk_heatmap_filename)
+		disk_dump_file(ucfg.disk_heatmap_filename, disk_dump_heatmap);
+}
+
+// Open FILENAME as UNIT.  If DELTA is not NULL, the image is only
+// read, and blocks written go to DELTA instead.
 int
-disk_init(int unit, char *filename)
+disk_init(int unit, char *filename, char *delta)
 {
 	uint32_t label[256];
 	int ret;
@@ -362,9 +1080,12 @@ disk_init(int unit, char *filename)
 	if (unit >= DISKS_MAX)
 		errx(1, "disk: only 8 disk devices are supported");
 
+	// The controller is shared by all units.
+	disk_setup();
+
 	INFO(TRACE_DISK, "disk: opening %s\n", filename);
 
-	disks[unit].fd = open(filename, O_RDWR | O_BINARY);
+	disks[unit].fd = open(filename, (delta ? O_RDONLY : O_RDWR) | O_BINARY);
 	if (disks[unit].fd < 0) {
 		disks[unit].fd = 0;
 		perror(filename);
@@ -374,21 +1095,122 @@ disk_init(int unit, char *filename)
 	struct stat st;
 	fstat(disks[unit].fd, &st);
 	INFO(TRACE_DISK, "disk: size: %zd bytes\n", st.st_size);
-	disks[unit].mm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, disks[unit].fd, 0);
+	if (st.st_size < BLOCKSZ) {
+		WARNING(TRACE_DISK, "disk: %s has no pack label - disk image ignored\n", filename);
+		close(disks[unit].fd);
+		disks[unit].fd = 0;
+		return -1;
+	}
+	disks[unit].mm = mmap(NULL, st.st_size, PROT_READ | (delta ? 0 : PROT_WRITE), MAP_SHARED, disks[unit].fd, 0);
+	if (disks[unit].mm == MAP_FAILED)
+		err(1, "disk: %s", filename);
+	disks[unit].blocks = st.st_size / BLOCKSZ;
 
+	// Check the image before a delta is opened, or created, for it.
 	ret = disk_read(unit, 0, label);
 	if (ret < 0 || label[0] != LABEL_LABL) {
 		WARNING(TRACE_DISK, "disk: invalid pack label (%o) - disk image ignored\n", label[0]);
+		munmap(disks[unit].mm, st.st_size);
+		disks[unit].mm = NULL;
+		disks[unit].blocks = 0;
 		close(disks[unit].fd);
 		disks[unit].fd = 0;
 		return -1;
 	}
 
+	if (delta) {
+		uint8_t *mm;
+
+		INFO(TRACE_DISK, "disk: delta %s\n", delta);
+		mm = delta_open(delta, disks[unit].blocks);
+		disks[unit].map = mm + BLOCKSZ;
+		disks[unit].delta = disks[unit].map + delta_map_size(disks[unit].blocks);
+
+		// The label may have been rewritten since.
+		disk_read(unit, 0, label);
+		if (label[0] != LABEL_LABL) {
+			WARNING(TRACE_DISK, "disk: %s has an invalid pack label (%o) - using the image's\n", delta, label[0]);
+			memcpy(label, disks[unit].mm, BLOCKSZ);
+		}
+	}
+
 	disks[unit].cyls = label[2];
 	disks[unit].heads = label[3];
 	disks[unit].blocks_per_track = label[4];
+	disk_label_parts(unit, label);
+	if (disk_preload_flag)
+		disk_preload(unit, label);
+
+	disks[unit].filename = filename;
+	if (disk_durability == DISK_PERIODIC) {
+		disks[unit].dirty = calloc((disks[unit].blocks / DISK_CHUNK + 8) / 8, 1);
+		if (disks[unit].dirty == NULL)
+			err(1, "disk: dirty map");
+	}
+
+	if (ucfg.disk_heatmap_filename) {
+		disks[unit].heat = calloc(2 * disks[unit].blocks, sizeof(uint32_t));
+		if (disks[unit].heat == NULL)
+			err(1, "disk: heatmap");
+	}
 
-	INFO(TRACE_DISK, "disk: image CHB %o/%o/%o\n", disks[unit].cyls, disks[unit].heads, disks[unit].blocks_per_track);
+	INFO(TRACE_DISK, "disk: unit %d CHB %o/%o/%o\n", unit, disks[unit].cyls, disks[unit].heads, disks[unit].blocks_per_track);
 
 	return 0;
 }
+
+// Copy the blocks in DELTA into the base image FILENAME, and remove
+// DELTA.
+void
+disk_commit(char *filename, char *delta)
+{
+	struct stat st;
+	uint32_t blocks;
+	uint8_t *base;
+	uint8_t *mm;
+	uint8_t *map;
+	uint8_t *data;
+	int count;
+	int fd;
+
+	if (stat(delta, &st) < 0) {
+		printf("disk: no delta %s to commit\n", delta);
+		return;
+	}
+
+	fd = open(filename, O_RDWR | O_BINARY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		err(1, "disk: %s", filename);
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		err(1, "disk: %s", filename);
+
+	blocks = st.st_size / BLOCKSZ;
+	mm = delta_open(delta, blocks);
+	map = mm + BLOCKSZ;
+	data = map + delta_map_size(blocks);
+
+	count = 0;
+	for (uint32_t b = 0; b < blocks; b++) {
+		if (BIT_TEST(map, b)) {
+			memcpy(base + (off_t) b * BLOCKSZ, data + (off_t) b * BLOCKSZ, BLOCKSZ);
+			count++;
+		}
+	}
+
+	if (msync(base, st.st_size, MS_SYNC) < 0)
+		err(1, "disk: %s", filename);
+	munmap(base, st.st_size);
+	close(fd);
+
+	disk_discard(delta);
+	printf("disk: committed %d blocks from %s to %s\n", count, delta, filename);
+}
+
+// Throw away the blocks written since the last commit.
+void
+disk_discard(char *delta)
+{
+	if (unlink(delta) < 0 && errno != ENOENT)
+		err(1, "disk: %s", delta);
+}
@@ -1,10 +1,15 @@
 #ifndef USIM_DISK_H
 #define USIM_DISK_H
 
-extern int disk_init(int unit, char *filename);
-extern void disk_poll(void);
+#define DISKS_MAX 8
 
-extern void disk_xbus_read(int offset, uint32_t *pv);
-extern void disk_xbus_write(int offset, uint32_t v);
+extern int disk_init(int unit, char *filename, char *delta);
+extern void disk_commit(char *filename, char *delta);
+extern void disk_discard(char *delta);
+extern void disk_drain(void);
+extern void disk_stats_dump(void);
+
+struct snapshot;
+extern void disk_snapshot(struct snapshot *s);
 
 #endif
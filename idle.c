@@ -0,0 +1,95 @@
+// idle.c --- sleep the host while the Lisp Machine is idle
+//
+// The machine is considered idle when, with interrupts enabled, no
+// device has been used for a whole window of microcycles.  It then
+// blocks in poll() on X11 input and the chaosnet connection until
+// there is input or the next 60 Hz tick, and keeps rechecking at a
+// much shorter interval until something happens.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <err.h>
+
+#include "usim.h"
+#include "ucfg.h"
+#include "utrace.h"
+#include "ucode.h"
+#include "sched.h"
+#include "x11.h"
+#include "chaos.h"
+#include "idle.h"
+
+#include "misc.h"
+
+#define IDLE_RECHECK_CYCLES 0x40000
+#define IDLE_SLEEP_MS 17	// A bit over one 60 Hz tick.
+
+bool idle_busy;
+bool idle_sleep_flag;
+
+static size_t idle_cycles;
+
+static void
+idle_sleep(void)
+{
+	struct pollfd pfd[2];
+	int nfds;
+	int ret;
+
+	if (x11_pending())
+		return;
+
+	nfds = 0;
+	pfd[nfds].fd = x11_fd();
+	pfd[nfds].events = POLLIN;
+	nfds++;
+
+	if (chaos_get_fd() > 0) {
+		pfd[nfds].fd = chaos_get_fd();
+		pfd[nfds].events = POLLIN;
+		nfds++;
+	}
+
+	ret = poll(pfd, nfds, IDLE_SLEEP_MS);
+	if (ret > 0) {
+		// Deliver the input now rather than at the next poll.
+		if (pfd[0].revents)
+			sched_at(SCHED_TV, ucode_cycles());
+		if (nfds > 1 && pfd[1].revents)
+			sched_at(SCHED_CHAOS, ucode_cycles());
+	}
+}
+
+static void
+idle_check(void)
+{
+	if (idle_busy || !ucode_interrupts_enabled() ||
+	    sched_pending(SCHED_DISK) || sched_pending(SCHED_KBD)) {
+		idle_busy = false;
+		sched_after(SCHED_IDLE, idle_cycles);
+		return;
+	}
+
+	DEBUG(TRACE_MISC, "idle: sleeping\n");
+	idle_sleep();
+	sched_after(SCHED_IDLE, IDLE_RECHECK_CYCLES);
+}
+
+void
+idle_init(void)
+{
+	char *end;
+
+	idle_sleep_flag = streq(ucfg.idle_sleep, "yes");
+	if (!idle_sleep_flag)
+		return;
+
+	idle_cycles = strtoul(ucfg.idle_cycles, &end, 0);
+	if (*end != 0 || idle_cycles < IDLE_RECHECK_CYCLES)
+		errx(1, "idle: cycles must be a number no smaller than %d", IDLE_RECHECK_CYCLES);
+
+	idle_busy = true;
+	sched_handler(SCHED_IDLE, idle_check);
+	sched_after(SCHED_IDLE, idle_cycles);
+}
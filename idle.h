@@ -0,0 +1,14 @@
+#ifndef USIM_IDLE_H
+#define USIM_IDLE_H
+
+#include <stdbool.h>
+
+// Set by devices whenever the Lisp Machine does something visible:
+// disk commands, keyboard, mouse and chaosnet traffic, and drawing.
+extern bool idle_busy;
+
+extern bool idle_sleep_flag;
+
+extern void idle_init(void);
+
+#endif
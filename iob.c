@@ -25,6 +25,8 @@
 #include "kbd.h"
 #include "mouse.h"
 #include "chaos.h"
+#include "mem.h"
+#include "snapshot.h"
 
 uint32_t iob_csr;
 static uint32_t cv;
@@ -74,7 +76,7 @@ get_60hz_clock(void)
 	return 0;
 }
 
-void
+static void
 iob_unibus_read(int offset, int *pv)
 {
 	*pv = 0;		// For now default to zero.
@@ -158,7 +160,7 @@ iob_unibus_read(int offset, int *pv)
 	}
 }
 
-void
+static void
 iob_unibus_write(int offset, int v)
 {
 	switch (offset) {
@@ -212,8 +214,25 @@ iob_unibus_write(int offset, int v)
 }
 
 void
-iob_poll(void)
+iob_snapshot(struct snapshot *s)
+{
+	SNAP(s, iob_csr);
+	SNAP(s, cv);
+}
+
+// The Unibus registers are at even byte addresses.
+static void
+iob_io_read(uint32_t vaddr, int offset, uint32_t *pv)
 {
+	(void) vaddr;
+	iob_unibus_read(offset << 1, (int *) pv);
+}
+
+static void
+iob_io_write(uint32_t vaddr, int offset, uint32_t v)
+{
+	DEBUG(TRACE_IOB, "unibus: iob v %o, offset %o\n", vaddr, offset << 1);
+	iob_unibus_write(offset << 1, v);
 }
 
 void
@@ -221,4 +240,6 @@ iob_init(void)
 {
 	kbd_init();
 	mouse_init();
+
+	io_register(037764, 0, 0377, iob_io_read, iob_io_write);
 }
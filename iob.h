@@ -4,9 +4,8 @@
 extern uint32_t iob_csr;
 
 extern int iob_init(void);
-extern void iob_poll(void);
 
-extern void iob_unibus_read(int offset, int *pv);
-extern void iob_unibus_write(int offset, int v);
+struct snapshot;
+extern void iob_snapshot(struct snapshot *s);
 
 #endif
@@ -12,10 +12,14 @@
 #include "ucode.h"
 #include "iob.h"
 #include "kbd.h"
+#include "sched.h"
+#include "idle.h"
+#include "snapshot.h"
 
 uint32_t kbd_key_scan;
 
 #define KEY_QUEUE_LEN 10
+#define KEY_DEQUEUE_CYCLES 0x10000
 
 static int key_queue[KEY_QUEUE_LEN];
 static int key_queue_optr = 0;
@@ -34,6 +38,8 @@ queue_key_event(int ev)
 		key_queue_free--;
 		key_queue[key_queue_optr] = v;
 		key_queue_optr = (key_queue_optr + 1) % KEY_QUEUE_LEN;
+		if (!sched_pending(SCHED_KBD))
+			sched_after(SCHED_KBD, KEY_DEQUEUE_CYCLES);
 	} else {
 		WARNING(TRACE_IOB, "IOB key queue full!");
 		if (!(iob_csr & (1 << 5)) && (iob_csr & (1 << 2))) {
@@ -44,13 +50,13 @@ queue_key_event(int ev)
 	}
 }
 
-void
+static void
 kbd_dequeue_key_event(void)
 {
-	if (iob_csr & (1 << 5))	// Already something to be read.
+	if (key_queue_free == KEY_QUEUE_LEN)
 		return;
 
-	if (key_queue_free < KEY_QUEUE_LEN) {
+	if ((iob_csr & (1 << 5)) == 0) { // Nothing waiting to be read.
 		int v = key_queue[key_queue_iptr];
 		DEBUG(TRACE_IOB, "dequeue_key_event() - dequeuing 0%o, q len before %d\n", v, KEY_QUEUE_LEN - key_queue_free);
 		key_queue_iptr = (key_queue_iptr + 1) % KEY_QUEUE_LEN;
@@ -62,8 +68,21 @@ kbd_dequeue_key_event(void)
 			assert_unibus_interrupt(0260);
 		}
 	}
+
+	if (key_queue_free < KEY_QUEUE_LEN)
+		sched_after(SCHED_KBD, KEY_DEQUEUE_CYCLES);
 }
-
+
+void
+kbd_snapshot(struct snapshot *s)
+{
+	SNAP(s, kbd_key_scan);
+	SNAP(s, key_queue);
+	SNAP(s, key_queue_optr);
+	SNAP(s, key_queue_iptr);
+	SNAP(s, key_queue_free);
+}
+
 void
 kbd_key_event(int code, int keydown)
 {
@@ -71,6 +90,8 @@ kbd_key_event(int code, int keydown)
 
 	DEBUG(TRACE_IOB, "key_event(code=%x, keydown=%x)\n", code, keydown);
 
+	idle_busy = true;
+
 	v = ((!keydown) << 8) | code;
 
 	if (iob_csr & (1 << 5))
@@ -195,4 +216,5 @@ void
 kbd_init(void)
 {
 	kbd_old_init();
+	sched_handler(SCHED_KBD, kbd_dequeue_key_event);
 }
@@ -10,6 +10,8 @@ extern unsigned short kbd_translate_table[3][256];
 extern void kbd_init(void);
 extern void kbd_warm_boot_key(void);
 extern void kbd_key_event(int code, int keydown);
-extern void kbd_dequeue_key_event(void);
+
+struct snapshot;
+extern void kbd_snapshot(struct snapshot *s);
 
 #endif
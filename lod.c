@@ -9,6 +9,7 @@
 #include "usim.h"
 #include "disass.h"
 #include "misc.h"
+#include "prof.h"
 
 static int show_comm;
 static int show_scratch;
@@ -239,10 +240,37 @@ find_and_dump_fef(uint32_t pc, int width)
 	return 0;
 }
 
+// Disassemble a macroinstruction stream written by usim.
+static void
+dump_macro_trace(char *fn)
+{
+	struct prof_macro_record r;
+	uint32_t fef;
+	FILE *f;
+
+	f = fopen(fn, "r");
+	if (f == NULL) {
+		perror(fn);
+		exit(1);
+	}
+
+	fef = ~0;
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (r.fef != fef) {
+			fef = r.fef;
+			printf("\nfef @ %o:\n", fef);
+		}
+		disassemble_instruction(r.fef, r.lc >> 2, (r.lc & 2) ? 0 : 1, r.inst);
+	}
+
+	fclose(f);
+}
+
 static void
 usage(void)
 {
 	fprintf(stderr, "usage: lod FILE [OPTION]... FILE\n");
+	fprintf(stderr, "       lod -t TRACE\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -A             dump everything\n");
 	fprintf(stderr, "  -c             dump system communication area\n");
@@ -253,6 +281,7 @@ usage(void)
 	fprintf(stderr, "  -a ADDR        find and disassemble FEF for given address\n");
 	fprintf(stderr, "  -m ADDR        dump memory\n");
 	fprintf(stderr, "  -w             decode 25-bit pointers\n");
+	fprintf(stderr, "  -t TRACE       disassemble a usim macroinstruction stream\n");
 	fprintf(stderr, "  -h             help message\n");
 }
 
@@ -263,8 +292,9 @@ main(int argc, char *argv[])
 	int c;
 	uint32_t pc = 0;
 	uint32_t addr = 0;
+	char *trace_fn = NULL;
 
-	while ((c = getopt(argc, argv, "Acsfgp:a:m:wh")) != -1) {
+	while ((c = getopt(argc, argv, "Acsfgp:a:m:wt:h")) != -1) {
 		switch (c) {
 		case 'A':
 			show_comm++;
@@ -300,6 +330,9 @@ main(int argc, char *argv[])
 		case 'w':
 			width = 25;
 			break;
+		case 't':
+			trace_fn = optarg;
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -311,6 +344,12 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (trace_fn != NULL) {
+		dump_macro_trace(trace_fn);
+		if (argc == 0)
+			exit(0);
+	}
+
 	if (argc != 1) {
 		usage();
 		exit(1);
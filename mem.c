@@ -2,31 +2,41 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <err.h>
 
 #include "usim.h"
 #include "utrace.h"
 #include "ucode.h"
 #include "mem.h"
+#include "snapshot.h"
 
 int phys_ram_pages = 8192;	// 2 MW.
 
-struct page_s *phy_pages[16 * 1024];
+// Physical memory, indexed by page number.  The first PHYS_RAM_PAGES
+// pages are RAM; XBUS pages that no device claims also land here.
+struct page_s *phy_mem;
 
 int l1_map[2048];
 int l2_map[1024];
 
-uint32_t last_virt = 0xffffff00;
-uint32_t last_l1;
-uint32_t last_l2;
+struct tlb_entry tlb[0200000];
+uint32_t tlb_gen = 1;
 
+// Drop every cached translation; called whenever the maps change.
 void
 invalidate_vtop_cache(void)
 {
-	last_virt = 0xffffff00;
+	tlb_gen++;
+	if (tlb_gen == 0) {
+		memset(tlb, 0, sizeof(tlb));
+		tlb_gen = 1;
+	}
 }
 
 // Map virtual address to physical address, possibly returning l1
@@ -79,53 +89,138 @@ map_vtop(uint32_t virt, int *pl1_map, int *poffset)
 	if (poffset)
 		*poffset = virt & 0377;
 
-	last_virt = virt & 0xffffff00;
-	last_l1 = l1;
-	last_l2 = l2;
-
 	return l2;
 }
-
-static char *page_block;
-static int page_block_count;
 
-static struct page_s *
-new_page(void)
+// Translate the page of VIRT into E.
+void
+tlb_fill(struct tlb_entry *e, uint32_t virt)
 {
 	struct page_s *page;
+	int pn;
 
-	if (page_block == 0) {
-		page_block = malloc(sizeof(struct page_s) * 1024);
-		page_block_count = 1024;
-	}
+	e->map = map_vtop(virt, &e->l1, (int *) 0);
+	e->gen = tlb_gen;
 
-	page = (struct page_s *) page_block;
+	pn = e->map & 037777;
+	page = phy_page(pn);
 
-	page_block += sizeof(struct page_s);
-	page_block_count--;
+	e->read = (e->map & (1 << 23)) ? page : 0;
+	e->write = (e->map & (1 << 22)) ? e->read : 0;
+}
+
+// Map the physical memory arena.  Pages are committed by the kernel
+// on first touch, so an unused arena costs nothing.
+void
+mem_init(void)
+{
+	size_t len;
 
-	if (page_block_count == 0)
-		page_block = 0;
+	len = (size_t) PHYS_PAGES * sizeof(struct page_s);
+	phy_mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (phy_mem == MAP_FAILED)
+		err(1, "mem: mmap");
 
-	return page;
+#ifdef MADV_HUGEPAGE
+	madvise(phy_mem, len, MADV_HUGEPAGE);
+#endif
 }
 
-// Add a new physical memory page, generally in response to L2 mapping
-// (but can also be due to physical access to RAM).
-int
-add_new_page_no(int pn)
+// Devices on the I/O pages, from PHYS_RAM_PAGES_MAX up.  A page may
+// be shared by several devices, each claiming a range of offsets.
+#define IO_RANGES_MAX 4
+
+struct io_range {
+	int first;
+	int last;
+	io_read_fn read;
+	io_write_fn write;
+};
+
+static struct io_page {
+	int n;
+	struct io_range r[IO_RANGES_MAX];
+} io_pages[PHYS_PAGES - PHYS_RAM_PAGES_MAX];
+
+// Have offsets FIRST to LAST of page PN handled by READ and WRITE,
+// either of which may be NULL.
+void
+io_register(int pn, int first, int last, io_read_fn read, io_write_fn write)
 {
-	struct page_s *page;
+	struct io_page *p;
+
+	if (pn < PHYS_RAM_PAGES_MAX || pn >= PHYS_PAGES)
+		errx(1, "mem: page %o is not an I/O page", pn);
+
+	p = &io_pages[pn - PHYS_RAM_PAGES_MAX];
+	if (p->n == IO_RANGES_MAX)
+		errx(1, "mem: too many devices on page %o", pn);
 
-	page = phy_pages[pn];
-	if (page == 0) {
-		page = new_page();
-		if (page) {
-			phy_pages[pn] = page;
-			return 0;
+	p->r[p->n].first = first;
+	p->r[p->n].last = last;
+	p->r[p->n].read = read;
+	p->r[p->n].write = write;
+	p->n++;
+}
+
+// Read I/O page PN; returns false if no device is registered on it.
+// Offsets that no device claims read as zero.
+bool
+io_read(int pn, uint32_t vaddr, int offset, uint32_t *pv)
+{
+	struct io_page *p;
+
+	p = &io_pages[pn - PHYS_RAM_PAGES_MAX];
+	if (p->n == 0)
+		return false;
+
+	for (int i = 0; i < p->n; i++) {
+		struct io_range *r;
+
+		r = &p->r[i];
+		if (r->read && offset >= r->first && offset <= r->last) {
+			r->read(vaddr, offset, pv);
+			return true;
 		}
 	}
-	return -1;
+
+	DEBUG(TRACE_MISC, "xbus read %o %o\n", offset, vaddr);
+	*pv = 0;
+	return true;
+}
+
+// Write I/O page PN; returns false if no device is registered on it.
+// Writes to offsets that no device claims are dropped.
+bool
+io_write(int pn, uint32_t vaddr, int offset, uint32_t v)
+{
+	struct io_page *p;
+
+	p = &io_pages[pn - PHYS_RAM_PAGES_MAX];
+	if (p->n == 0)
+		return false;
+
+	for (int i = 0; i < p->n; i++) {
+		struct io_range *r;
+
+		r = &p->r[i];
+		if (r->write && offset >= r->first && offset <= r->last) {
+			r->write(vaddr, offset, v);
+			return true;
+		}
+	}
+
+	DEBUG(TRACE_MISC, "xbus write %o %o, v %o\n", offset, vaddr, v);
+	return true;
+}
+
+// Return physical page PN, or NULL if it is not RAM.
+struct page_s *
+phy_page(int pn)
+{
+	if (pn < 0 || pn >= phys_ram_pages)
+		return NULL;
+	return &phy_mem[pn];
 }
 
 // Read physical memory, with no virtual-to-physical mapping (used by
@@ -135,25 +230,36 @@ read_phy_mem(int paddr, uint32_t *pv)
 {
 	int pn;
 	int offset;
-	struct page_s *page;
 
 	pn = paddr >> 8;
 	offset = paddr & 0377;
 
-	page = phy_pages[pn];
-	if (page == 0) {
-		// Page does not exist.
-		if (pn < phys_ram_pages) {
-			DEBUG(TRACE_MISC, "[read_phy_mem] adding phy ram page %o (address %o)\n", pn, paddr);
-			add_new_page_no(pn);
-			page = phy_pages[pn];
-		} else {
-			DEBUG(TRACE_MISC, "[read_phy_mem] address %o does not exist\n", paddr);
-			return -1;
-		}
+	if (pn >= phys_ram_pages) {
+		DEBUG(TRACE_MISC, "[read_phy_mem] address %o does not exist\n", paddr);
+		return -1;
 	}
 
-	*pv = page->w[offset];
+	*pv = phy_mem[pn].w[offset];
+
+	return 0;
+}
+
+// Read virtual memory without side effects, for the profiler;
+// returns -1 if the page is not resident.
+int
+read_virt_mem(uint32_t vaddr, uint32_t *pv)
+{
+	uint32_t map;
+	int offset;
+	int pn;
+
+	map = map_vtop(vaddr, (int *) 0, &offset);
+	pn = map & 037777;
+
+	if ((map & (1 << 23)) == 0 || pn >= phys_ram_pages)
+		return -1;
+
+	*pv = phy_mem[pn].w[offset];
 
 	return 0;
 }
@@ -163,37 +269,26 @@ write_phy_mem(int paddr, uint32_t v)
 {
 	int pn;
 	int offset;
-	struct page_s *page;
 
 	pn = paddr >> 8;
 	offset = paddr & 0377;
 
-	page = phy_pages[pn];
-	if (page == 0) {
-		// Page does not exist - add it (probably result of
-		// disk write).
-		if (pn < phys_ram_pages) {
-			DEBUG(TRACE_MISC, "[write_phy_mem] adding phy ram page %o (address %o)\n", pn, paddr);
-			add_new_page_no(pn);
-			page = phy_pages[pn];
-		} else {
-			DEBUG(TRACE_MISC, "[write_phy_mem] address %o does not exist\n", paddr);
-			return -1;
-		}
+	if (pn >= phys_ram_pages) {
+		DEBUG(TRACE_MISC, "[write_phy_mem] address %o does not exist\n", paddr);
+		return -1;
 	}
 
-	page->w[offset] = v;
+	phy_mem[pn].w[offset] = v;
 
 	return 0;
 }
-
-#define PAGES_TO_SAVE 8192
 
 static bool restored = false;
 
 int
 restore_state(char *fn)
 {
+	size_t len;
 	int fd;
 
 	if (restored == true)
@@ -204,16 +299,10 @@ restore_state(char *fn)
 	if (fd < 0)
 		return -1;
 
-	for (int i = 0; i < PAGES_TO_SAVE; i++) {
-		ssize_t ret;
-
-		add_new_page_no(i);
-
-		ret = read(fd, (char *) phy_pages[i], sizeof(struct page_s));
-		if (ret < 0) {
-			close(fd);
-			return -1;
-		}
+	len = (size_t) phys_ram_pages * sizeof(struct page_s);
+	if (read(fd, phy_mem, len) < 0) {
+		close(fd);
+		return -1;
 	}
 
 	close(fd);
@@ -224,23 +313,44 @@ restore_state(char *fn)
 int
 save_state(char *fn)
 {
+	size_t len;
 	int fd;
 
 	fd = open(fn, O_RDWR | O_CREAT, 0666);
 	if (fd < 0)
 		return -1;
 
-	for (int i = 0; i < PAGES_TO_SAVE; i++) {
-		ssize_t ret;
-
-		ret = write(fd, (char *) phy_pages[i], sizeof(struct page_s));
-		if (ret < 0) {
-			close(fd);
-			return -1;
-		}
+	len = (size_t) phys_ram_pages * sizeof(struct page_s);
+	if (write(fd, phy_mem, len) < 0) {
+		close(fd);
+		return -1;
 	}
 
 	close(fd);
 
 	return 0;
 }
+
+// RAM and the XBUS pages are saved as one block each; the amount of
+// RAM must be the same when restoring.
+void
+mem_snapshot(struct snapshot *s)
+{
+	int pages;
+
+	pages = phys_ram_pages;
+	SNAP(s, pages);
+	if (pages != phys_ram_pages) {
+		WARNING(TRACE_MISC, "mem: snapshot has %d pages of RAM, not %d\n", pages, phys_ram_pages);
+		s->error = true;
+		return;
+	}
+
+	SNAP(s, l1_map);
+	SNAP(s, l2_map);
+	snap_io(s, phy_mem, (size_t) phys_ram_pages * sizeof(struct page_s));
+	snap_io(s, &phy_mem[036000], (size_t) (PHYS_PAGES - 036000) * sizeof(struct page_s));
+
+	if (s->restore)
+		invalidate_vtop_cache();
+}
@@ -5,24 +5,66 @@ struct page_s {
 	uint32_t w[256];
 };
 
-extern struct page_s *phy_pages[16 * 1024];
+#define PHYS_PAGES (16 * 1024)	// 14 bit physical page number.
+#define PHYS_RAM_PAGES_MAX 036000 // XBUS I/O space starts here.
+
+extern struct page_s *phy_mem;
 extern int phys_ram_pages;
 
 extern int l1_map[2048];
 extern int l2_map[1024];
-extern uint32_t last_virt;
-extern uint32_t last_l1;
-extern uint32_t last_l2;
+
+// Software TLB, one entry per virtual page.  An entry is valid while
+// its generation matches TLB_GEN, so invalidating them all is a
+// single increment.
+struct tlb_entry {
+	uint32_t gen;
+	uint32_t map;		// L2 map data: access bits and page.
+	int l1;			// L1 map data.
+	struct page_s *read;	// RAM page if readable, else NULL.
+	struct page_s *write;	// RAM page if writable, else NULL.
+};
+
+extern struct tlb_entry tlb[0200000];
+extern uint32_t tlb_gen;
+
+extern void mem_init(void);
+
+// Device access to an I/O page.  VADDR is the virtual address used,
+// OFFSET the word offset in the page.
+typedef void (*io_read_fn)(uint32_t vaddr, int offset, uint32_t *pv);
+typedef void (*io_write_fn)(uint32_t vaddr, int offset, uint32_t v);
+
+extern void io_register(int pn, int first, int last, io_read_fn read, io_write_fn write);
+extern bool io_read(int pn, uint32_t vaddr, int offset, uint32_t *pv);
+extern bool io_write(int pn, uint32_t vaddr, int offset, uint32_t v);
 
 extern void invalidate_vtop_cache(void);
 
 extern uint32_t map_vtop(uint32_t virt, int *pl1_map, int *poffset);
+extern void tlb_fill(struct tlb_entry *e, uint32_t virt);
+
+static inline struct tlb_entry *
+tlb_lookup(uint32_t virt)
+{
+	struct tlb_entry *e;
+
+	e = &tlb[(virt >> 8) & 0177777];
+	if (e->gen != tlb_gen)
+		tlb_fill(e, virt);
 
+	return e;
+}
+
+extern struct page_s *phy_page(int pn);
 extern int write_phy_mem(int paddr, uint32_t v);
-extern int add_new_page_no(int pn);
 extern int read_phy_mem(int paddr, uint32_t *pv);
+extern int read_virt_mem(uint32_t vaddr, uint32_t *pv);
 
 extern int restore_state(char *fn);
 extern int save_state(char *fn);
 
+struct snapshot;
+extern void mem_snapshot(struct snapshot *s);
+
 #endif
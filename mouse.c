@@ -6,6 +6,8 @@
 #include "usim.h"
 #include "ucode.h"
 #include "iob.h"
+#include "idle.h"
+#include "snapshot.h"
 
 #include "syms.h"
 
@@ -24,6 +26,7 @@ static int mouse_amem_y;
 void
 mouse_event(int x, int y, int buttons)
 {
+	idle_busy = true;
 	iob_csr |= 1 << 4;
 	assert_unibus_interrupt(0264);
 
@@ -49,6 +52,20 @@ mouse_event(int x, int y, int buttons)
 		mouse_tail = 1;
 }
 
+// The A memory locations of the mouse state come from the symbol
+// table, and are not saved.
+void
+mouse_snapshot(struct snapshot *s)
+{
+	SNAP(s, mouse_x);
+	SNAP(s, mouse_y);
+	SNAP(s, mouse_head);
+	SNAP(s, mouse_middle);
+	SNAP(s, mouse_tail);
+	SNAP(s, mouse_rawx);
+	SNAP(s, mouse_rawy);
+}
+
 void
 mouse_init(void)
 {
@@ -13,4 +13,7 @@ extern int mouse_poll_delay;
 extern void mouse_event(int x, int y, int buttons);
 extern void mouse_init(void);
 
+struct snapshot;
+extern void mouse_snapshot(struct snapshot *s);
+
 #endif
@@ -0,0 +1,683 @@
+// prof.c --- microcode profiler
+//
+// The profiled variant of run() counts every microinstruction it
+// executes, and a scheduler event samples the SPC stack every
+// PROF_SAMPLE_CYCLES.  On exit, or on SIGUSR2, two files are written:
+// FILENAME with the counts per routine and per location, symbolized
+// through the microcode symbol table, and FILENAME.folded with the
+// sampled call stacks, one "caller;...;callee count" line each, as
+// used by flame graph tools.
+//
+// The macrocode profiler is told about every macroinstruction the
+// instruction stream hardware advances over.  The containing FEF is
+// found by searching back from the LC for its header, and kept while
+// execution stays inside it.  Counts per FEF and per opcode are
+// written to the macrocode profile, and each instruction can also be
+// appended to a binary stream of struct prof_macro_record, which
+// "lod -t" disassembles.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "usim.h"
+#include "utrace.h"
+#include "ucode.h"
+#include "sched.h"
+#include "mem.h"
+#include "misc.h"
+#include "disass.h"
+#include "prof.h"
+
+#define PROF_SAMPLE_CYCLES 997	// Prime, so as not to beat with loops.
+#define PROF_DEPTH 33		// SPC stack and current location.
+
+#define DTP_SYMBOL 3
+#define DTP_SYMBOL_HEADER 4
+#define DTP_HEADER 7
+#define Q_DATA_TYPE(q) (((q) >> 24) & 037)
+#define Q_POINTER(q) ((q) & 077777777)
+
+#define FEF_MAX_WORDS 07777	// %FEFHI-STORAGE-LENGTH is 12 bits.
+
+uint64_t prof_counts[16 * 1024];
+bool prof_flag;
+bool prof_macro_flag;
+
+static char *prof_filename;
+static char *prof_macro_filename;
+static FILE *prof_macro_stream;
+
+struct prof_stack {
+	uint64_t count;
+	int depth;
+	uint16_t pc[PROF_DEPTH];
+};
+
+// Open addressing hash table of sampled stacks.
+static struct prof_stack *stacks;
+static size_t stacks_size;
+static size_t stacks_used;
+
+static uint32_t
+stack_hash(int *pcs, int n)
+{
+	uint32_t h;
+
+	h = 2166136261U;
+	for (int i = 0; i < n; i++) {
+		h ^= pcs[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static struct prof_stack *
+stack_find(int *pcs, int n)
+{
+	struct prof_stack *s;
+	size_t i;
+
+	i = stack_hash(pcs, n) & (stacks_size - 1);
+	for (;;) {
+		s = &stacks[i];
+		if (s->count == 0)
+			return s;
+		if (s->depth == n) {
+			int j;
+
+			for (j = 0; j < n; j++) {
+				if (s->pc[j] != pcs[j])
+					break;
+			}
+			if (j == n)
+				return s;
+		}
+		i = (i + 1) & (stacks_size - 1);
+	}
+}
+
+static void
+stacks_grow(void)
+{
+	struct prof_stack *old;
+	size_t old_size;
+
+	old = stacks;
+	old_size = stacks_size;
+
+	stacks_size = old_size ? old_size * 2 : 4096;
+	stacks = calloc(stacks_size, sizeof(struct prof_stack));
+	if (stacks == NULL)
+		err(1, "prof: calloc");
+
+	for (size_t i = 0; i < old_size; i++) {
+		int pcs[PROF_DEPTH];
+
+		if (old[i].count == 0)
+			continue;
+		for (int j = 0; j < old[i].depth; j++)
+			pcs[j] = old[i].pc[j];
+		*stack_find(pcs, old[i].depth) = old[i];
+	}
+
+	free(old);
+}
+
+static void
+prof_sample(void)
+{
+	struct prof_stack *s;
+	int pcs[PROF_DEPTH];
+	int n;
+
+	sched_after(SCHED_PROF, PROF_SAMPLE_CYCLES);
+
+	n = ucode_backtrace(pcs, PROF_DEPTH);
+	if (n == 0)
+		return;
+
+	if (stacks_used * 10 >= stacks_size * 7)
+		stacks_grow();
+
+	s = stack_find(pcs, n);
+	if (s->count == 0) {
+		s->depth = n;
+		for (int i = 0; i < n; i++)
+			s->pc[i] = pcs[i];
+		stacks_used++;
+	}
+	s->count++;
+}
+
+// Name of the routine containing PC, and the offset into it.
+static char *
+prof_sym(int pc, int *offset)
+{
+	char *name;
+
+	*offset = 0;
+	name = sym_find_by_type_val(&sym_mcr, IMEM, pc, offset);
+	if (name == NULL) {
+		*offset = pc;
+		return "?";
+	}
+
+	return name;
+}
+
+struct prof_entry {
+	char *name;
+	int pc;
+	uint64_t count;
+};
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct prof_entry *x = a;
+	const struct prof_entry *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->pc - y->pc;
+}
+
+static void
+dump_counts(FILE *f)
+{
+	static struct prof_entry pcs[16 * 1024];
+	static struct prof_entry routines[16 * 1024];
+	int npcs;
+	int nroutines;
+	uint64_t total;
+
+	npcs = 0;
+	nroutines = 0;
+	total = 0;
+
+	for (int pc = 0; pc < 16 * 1024; pc++) {
+		char *name;
+		int offset;
+
+		if (prof_counts[pc] == 0)
+			continue;
+
+		name = prof_sym(pc, &offset);
+		pcs[npcs].name = name;
+		pcs[npcs].pc = pc;
+		pcs[npcs].count = prof_counts[pc];
+		npcs++;
+		total += prof_counts[pc];
+
+		// Locations are visited in order, so a routine's
+		// locations are adjacent.
+		if (nroutines == 0 || routines[nroutines - 1].name != name || pc - offset != routines[nroutines - 1].pc) {
+			routines[nroutines].name = name;
+			routines[nroutines].pc = pc - offset;
+			routines[nroutines].count = 0;
+			nroutines++;
+		}
+		routines[nroutines - 1].count += prof_counts[pc];
+	}
+
+	if (total == 0)
+		return;
+
+	qsort(pcs, npcs, sizeof(pcs[0]), entry_cmp);
+	qsort(routines, nroutines, sizeof(routines[0]), entry_cmp);
+
+	fprintf(f, "# %llu microinstructions\n", (unsigned long long) total);
+	fprintf(f, "\n# routine\n");
+	for (int i = 0; i < nroutines; i++) {
+		fprintf(f, "%14llu %6.2f%% %05o %s\n",
+			(unsigned long long) routines[i].count,
+			100.0 * routines[i].count / total,
+			routines[i].pc, routines[i].name);
+	}
+
+	fprintf(f, "\n# location\n");
+	for (int i = 0; i < npcs; i++) {
+		int offset;
+
+		prof_sym(pcs[i].pc, &offset);
+		fprintf(f, "%14llu %6.2f%% %05o %s+%o\n",
+			(unsigned long long) pcs[i].count,
+			100.0 * pcs[i].count / total,
+			pcs[i].pc, pcs[i].name, offset);
+	}
+}
+
+static void
+dump_stacks(FILE *f)
+{
+	for (size_t i = 0; i < stacks_size; i++) {
+		struct prof_stack *s;
+
+		s = &stacks[i];
+		if (s->count == 0)
+			continue;
+
+		for (int j = 0; j < s->depth; j++) {
+			char *name;
+			int offset;
+
+			if (j)
+				fputc(';', f);
+
+			name = sym_find_by_type_val(&sym_mcr, IMEM, s->pc[j], &offset);
+			if (name)
+				fputs(name, f);
+			else
+				fprintf(f, "%05o", s->pc[j]);
+		}
+		fprintf(f, " %llu\n", (unsigned long long) s->count);
+	}
+}
+
+struct prof_fef {
+	uint32_t addr;		// 0 if the slot is free.
+	uint32_t len;
+	uint64_t count;
+	char name[64];
+};
+
+// Open addressing hash table of FEFs, by address.
+static struct prof_fef *fefs;
+static size_t fefs_size;
+static size_t fefs_used;
+
+// The FEF being executed, or NULL if it wasn't found.
+static struct prof_fef *cur_fef;
+
+// Words known to lie in no FEF, from the last failed search.
+static uint32_t miss_lo = 1;
+static uint32_t miss_hi = 0;
+
+static uint64_t macro_counts[0200000];
+static uint64_t macro_total;
+
+static struct prof_fef *
+fef_find(uint32_t addr)
+{
+	size_t i;
+
+	i = (addr * 2654435761U) & (fefs_size - 1);
+	while (fefs[i].addr != 0 && fefs[i].addr != addr)
+		i = (i + 1) & (fefs_size - 1);
+
+	return &fefs[i];
+}
+
+static void
+fefs_grow(void)
+{
+	struct prof_fef *old;
+	size_t old_size;
+	uint32_t cur;
+
+	old = fefs;
+	old_size = fefs_size;
+	cur = cur_fef ? cur_fef->addr : 0;
+
+	fefs_size = old_size ? old_size * 2 : 1024;
+	fefs = calloc(fefs_size, sizeof(struct prof_fef));
+	if (fefs == NULL)
+		err(1, "prof: calloc");
+
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i].addr != 0)
+			*fef_find(old[i].addr) = old[i];
+	}
+
+	free(old);
+
+	cur_fef = cur ? fef_find(cur) : NULL;
+}
+
+// Copy the print name of the function named by Q to NAME.
+static bool
+fef_name(uint32_t q, char *name, size_t len)
+{
+	uint32_t v;
+	uint32_t n;
+	size_t i;
+
+	// Follow the symbol to its header, and that to the name
+	// string.
+	for (int depth = 0; depth < 2; depth++) {
+		if (read_virt_mem(Q_POINTER(q), &v) < 0)
+			return false;
+		if (Q_DATA_TYPE(v) == DTP_SYMBOL_HEADER)
+			break;
+		if (Q_DATA_TYPE(v) != DTP_SYMBOL)
+			return false;
+		q = v;
+	}
+	if (Q_DATA_TYPE(v) != DTP_SYMBOL_HEADER)
+		return false;
+
+	if (read_virt_mem(Q_POINTER(v), &n) < 0)
+		return false;
+	n &= 0377;
+
+	for (i = 0; i < n && i < len - 1; i++) {
+		uint32_t w;
+
+		if (read_virt_mem(Q_POINTER(v) + 1 + i / 4, &w) < 0)
+			return false;
+		name[i] = (w >> (8 * (i % 4))) & 0377;
+	}
+	name[i] = 0;
+
+	return true;
+}
+
+// Find the FEF containing the instruction at LC by searching back for
+// a header word whose code range covers it.
+//
+// A failed search leaves MISS_LO..MISS_HI, a run of words with no
+// header that are in no FEF.  A search that gets back into it without
+// passing a header fails the same way, and extends it, so straight-line
+// code outside any known FEF isn't rescanned on every instruction.
+static struct prof_fef *
+fef_lookup(uint32_t lc)
+{
+	struct prof_fef *f;
+	uint32_t addr;
+	uint32_t h;
+	uint32_t len;
+	uint32_t start;
+	bool found;
+	bool passed;
+	bool cacheable;
+
+	found = false;
+	passed = false;
+	cacheable = true;
+	addr = lc >> 2;
+	for (int i = 0; i < FEF_MAX_WORDS && addr > 0; i++, addr--) {
+		if (!passed && addr >= miss_lo && addr <= miss_hi) {
+			if ((lc >> 2) > miss_hi)
+				miss_hi = lc >> 2;
+			return NULL;
+		}
+		if (read_virt_mem(addr, &h) < 0)
+			return NULL;
+		if (Q_DATA_TYPE(h) != DTP_HEADER)
+			continue;
+		if (read_virt_mem(addr + 1, &len) < 0)
+			return NULL;
+		len &= FEF_MAX_WORDS;
+
+		// Header word holds the code offset in halfwords.
+		start = addr * 2 + (h & 0777);
+		if ((lc >> 1) >= start && (lc >> 2) < addr + len) {
+			found = true;
+			break;
+		}
+		passed = true;
+
+		// A later LC could still land in this code.
+		if ((lc >> 1) < start)
+			cacheable = false;
+	}
+	if (!found) {
+		if (cacheable) {
+			miss_lo = lc >> 2;
+			miss_hi = lc >> 2;
+		}
+		return NULL;
+	}
+
+	if (fefs_used * 10 >= fefs_size * 7)
+		fefs_grow();
+
+	f = fef_find(addr);
+	if (f->addr == 0) {
+		uint32_t q;
+
+		f->addr = addr;
+		f->len = len;
+		if (read_virt_mem(addr + 2, &q) < 0 || !fef_name(q, f->name, sizeof(f->name)))
+			snprintf(f->name, sizeof(f->name), "fef@%o", addr);
+		fefs_used++;
+	}
+
+	return f;
+}
+
+// Called for every macroinstruction; LC is its byte address.
+void
+prof_macro(uint32_t lc)
+{
+	uint32_t w;
+	uint32_t inst;
+
+	lc &= 0377777777;
+
+	if (cur_fef == NULL || (lc >> 2) < cur_fef->addr || (lc >> 2) >= cur_fef->addr + cur_fef->len)
+		cur_fef = fef_lookup(lc);
+
+	if (read_virt_mem(lc >> 2, &w) < 0)
+		w = 0;
+	inst = ((lc & 2) ? (w >> 16) : w) & 0177777;
+
+	macro_total++;
+	macro_counts[inst]++;
+	if (cur_fef)
+		cur_fef->count++;
+
+	if (prof_macro_stream) {
+		struct prof_macro_record r;
+
+		r.fef = cur_fef ? cur_fef->addr : 0;
+		r.lc = lc;
+		r.inst = inst;
+		fwrite(&r, sizeof(r), 1, prof_macro_stream);
+	}
+
+	if (trace_enabled(TRACE_MACROCODE, LOG_DEBUG)) {
+		char op[64];
+
+		disassemble_opcode(inst, op, sizeof(op));
+		DEBUG(TRACE_MACROCODE, "macro: %011o%c %06o %s (%s)\n",
+		      lc >> 2, (lc & 2) ? 'o' : 'e', inst, op,
+		      cur_fef ? cur_fef->name : "?");
+	}
+}
+
+struct prof_opcode {
+	char name[64];
+	uint64_t count;
+};
+
+static int
+fef_cmp(const void *a, const void *b)
+{
+	const struct prof_fef *x = a;
+	const struct prof_fef *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int
+opcode_name_cmp(const void *a, const void *b)
+{
+	const struct prof_opcode *x = a;
+	const struct prof_opcode *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+static int
+opcode_count_cmp(const void *a, const void *b)
+{
+	const struct prof_opcode *x = a;
+	const struct prof_opcode *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+static void
+dump_macro(FILE *f)
+{
+	struct prof_fef *sorted;
+	struct prof_opcode *ops;
+	uint64_t known;
+	size_t nfefs;
+	size_t nops;
+	size_t n;
+
+	if (macro_total == 0)
+		return;
+
+	fprintf(f, "# %llu macroinstructions\n", (unsigned long long) macro_total);
+
+	sorted = calloc(fefs_size ? fefs_size : 1, sizeof(struct prof_fef));
+	if (sorted == NULL)
+		err(1, "prof: calloc");
+	nfefs = 0;
+	known = 0;
+	for (size_t i = 0; i < fefs_size; i++) {
+		if (fefs[i].count == 0)
+			continue;
+		sorted[nfefs++] = fefs[i];
+		known += fefs[i].count;
+	}
+	qsort(sorted, nfefs, sizeof(sorted[0]), fef_cmp);
+
+	fprintf(f, "\n# function\n");
+	for (size_t i = 0; i < nfefs; i++) {
+		fprintf(f, "%14llu %6.2f%% %011o %s\n",
+			(unsigned long long) sorted[i].count,
+			100.0 * sorted[i].count / macro_total,
+			sorted[i].addr, sorted[i].name);
+	}
+	if (known != macro_total) {
+		fprintf(f, "%14llu %6.2f%% %11s ?\n",
+			(unsigned long long) (macro_total - known),
+			100.0 * (macro_total - known) / macro_total, "");
+	}
+	free(sorted);
+
+	// Merge the instruction counts by mnemonic.
+	ops = calloc(0200000, sizeof(struct prof_opcode));
+	if (ops == NULL)
+		err(1, "prof: calloc");
+	nops = 0;
+	for (uint32_t inst = 0; inst < 0200000; inst++) {
+		if (macro_counts[inst] == 0)
+			continue;
+		disassemble_opcode(inst, ops[nops].name, sizeof(ops[nops].name));
+		ops[nops].count = macro_counts[inst];
+		nops++;
+	}
+	qsort(ops, nops, sizeof(ops[0]), opcode_name_cmp);
+
+	n = 0;
+	for (size_t i = 0; i < nops; i++) {
+		if (n > 0 && streq(ops[n - 1].name, ops[i].name))
+			ops[n - 1].count += ops[i].count;
+		else
+			ops[n++] = ops[i];
+	}
+	qsort(ops, n, sizeof(ops[0]), opcode_count_cmp);
+
+	fprintf(f, "\n# opcode\n");
+	for (size_t i = 0; i < n; i++) {
+		fprintf(f, "%14llu %6.2f%% %s\n",
+			(unsigned long long) ops[i].count,
+			100.0 * ops[i].count / macro_total,
+			ops[i].name);
+	}
+	free(ops);
+}
+
+static void
+dump_file(char *fn, void (*dump)(FILE *))
+{
+	FILE *f;
+
+	f = fopen(fn, "w");
+	if (f == NULL) {
+		warn("prof: %s", fn);
+		return;
+	}
+	dump(f);
+	fclose(f);
+
+	NOTICE(TRACE_MICROCODE, "prof: wrote %s\n", fn);
+}
+
+// Write the report files.
+void
+prof_dump(void)
+{
+	if (prof_flag) {
+		char fn[1024];
+
+		dump_file(prof_filename, dump_counts);
+		snprintf(fn, sizeof(fn), "%s.folded", prof_filename);
+		dump_file(fn, dump_stacks);
+	}
+
+	if (prof_macro_filename)
+		dump_file(prof_macro_filename, dump_macro);
+
+	if (prof_macro_stream)
+		fflush(prof_macro_stream);
+}
+
+// Arrange for the reports to be written on exit; usim writes them on
+// SIGUSR2 as well.
+static void
+prof_start(void)
+{
+	static bool started;
+
+	if (started)
+		return;
+	started = true;
+
+	atexit(prof_dump);
+}
+
+void
+prof_init(char *filename)
+{
+	prof_filename = filename;
+	prof_flag = true;
+
+	sched_handler(SCHED_PROF, prof_sample);
+	sched_after(SCHED_PROF, PROF_SAMPLE_CYCLES);
+
+	prof_start();
+}
+
+// Start the macrocode profiler if a report, a stream or macrocode
+// tracing was asked for.
+void
+prof_macro_init(char *filename, char *stream_filename)
+{
+	if (filename == NULL && stream_filename == NULL && !trace_enabled(TRACE_MACROCODE, LOG_DEBUG))
+		return;
+
+	if (stream_filename) {
+		prof_macro_stream = fopen(stream_filename, "w");
+		if (prof_macro_stream == NULL)
+			err(1, "prof: %s", stream_filename);
+		setvbuf(prof_macro_stream, NULL, _IOFBF, 1024 * 1024);
+	}
+
+	prof_macro_filename = filename;
+	prof_macro_flag = true;
+
+	prof_start();
+}
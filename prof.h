@@ -0,0 +1,26 @@
+#ifndef USIM_PROF_H
+#define USIM_PROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Executions per control memory location, counted by the profiled
+// variant of run().
+extern uint64_t prof_counts[16 * 1024];
+
+extern bool prof_flag;
+extern bool prof_macro_flag;
+
+// One macroinstruction in the binary stream.
+struct prof_macro_record {
+	uint32_t fef;		// Word address of the FEF, or 0.
+	uint32_t lc;		// Byte address of the instruction.
+	uint32_t inst;
+};
+
+extern void prof_init(char *filename);
+extern void prof_macro_init(char *filename, char *stream_filename);
+extern void prof_macro(uint32_t lc);
+extern void prof_dump(void);
+
+#endif
@@ -0,0 +1,218 @@
+// sched.c --- device event scheduler
+//
+// Devices post events for an absolute microcycle count instead of
+// being polled every cycle.  Pending events are kept in a binary
+// min-heap ordered by cycle, so the microcode loop only has to
+// compare the cycle counter against SCHED_NEXT.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include "usim.h"
+#include "utrace.h"
+#include "ucode.h"
+#include "sched.h"
+#include "snapshot.h"
+
+volatile size_t sched_next = SIZE_MAX;
+
+struct sched_event {
+	void (*fn)(void);
+	size_t when;
+	int slot;		// 1 + index in HEAP, or 0 if idle.
+};
+
+static struct sched_event events[SCHED_EVENTS];
+static int heap[SCHED_EVENTS];
+static int heap_len;
+
+// Set from signal handlers; see sched_async().
+static volatile sig_atomic_t async_flag[SCHED_EVENTS];
+
+static void
+heap_swap(int i, int j)
+{
+	int t;
+
+	t = heap[i];
+	heap[i] = heap[j];
+	heap[j] = t;
+
+	events[heap[i]].slot = i + 1;
+	events[heap[j]].slot = j + 1;
+}
+
+static void
+heap_up(int i)
+{
+	while (i > 0) {
+		int p;
+
+		p = (i - 1) / 2;
+		if (events[heap[p]].when <= events[heap[i]].when)
+			break;
+		heap_swap(i, p);
+		i = p;
+	}
+}
+
+static void
+heap_down(int i)
+{
+	for (;;) {
+		int l;
+		int r;
+		int m;
+
+		l = 2 * i + 1;
+		r = l + 1;
+		m = i;
+
+		if (l < heap_len && events[heap[l]].when < events[heap[m]].when)
+			m = l;
+		if (r < heap_len && events[heap[r]].when < events[heap[m]].when)
+			m = r;
+		if (m == i)
+			break;
+		heap_swap(i, m);
+		i = m;
+	}
+}
+
+static void
+heap_remove(int i)
+{
+	int ev;
+
+	ev = heap[i];
+	heap_len--;
+	if (i != heap_len) {
+		heap[i] = heap[heap_len];
+		events[heap[i]].slot = i + 1;
+		heap_up(i);
+		heap_down(i);
+	}
+	events[ev].slot = 0;
+}
+
+// Recompute SCHED_NEXT.  The asynchronous flags are checked after
+// the store, so an event posted from a signal handler in between is
+// not lost.
+static void
+update_next(void)
+{
+	sched_next = heap_len ? events[heap[0]].when : SIZE_MAX;
+
+	for (int ev = 0; ev < SCHED_EVENTS; ev++) {
+		if (async_flag[ev])
+			sched_next = 0;
+	}
+}
+
+// Set the function to call when event EV fires.
+void
+sched_handler(int ev, void (*fn)(void))
+{
+	events[ev].fn = fn;
+}
+
+// Post event EV for cycle WHEN, replacing any earlier posting.
+void
+sched_at(int ev, size_t when)
+{
+	struct sched_event *e;
+
+	e = &events[ev];
+	e->when = when;
+
+	if (e->slot == 0) {
+		heap[heap_len] = ev;
+		e->slot = ++heap_len;
+	}
+
+	heap_up(e->slot - 1);
+	heap_down(e->slot - 1);
+
+	update_next();
+}
+
+// Post event EV for DELAY cycles from now.
+void
+sched_after(int ev, size_t delay)
+{
+	sched_at(ev, ucode_cycles() + delay);
+}
+
+void
+sched_cancel(int ev)
+{
+	if (events[ev].slot == 0)
+		return;
+
+	heap_remove(events[ev].slot - 1);
+	update_next();
+}
+
+int
+sched_pending(int ev)
+{
+	return events[ev].slot != 0;
+}
+
+// Post event EV for the next cycle.  Safe to call from a signal
+// handler.
+void
+sched_async(int ev)
+{
+	async_flag[ev] = 1;
+	sched_next = 0;
+}
+
+// Fire every event that is due at cycle NOW.
+void
+sched_run(size_t now)
+{
+	for (int ev = 0; ev < SCHED_EVENTS; ev++) {
+		if (async_flag[ev]) {
+			async_flag[ev] = 0;
+			if (events[ev].fn)
+				events[ev].fn();
+		}
+	}
+
+	while (heap_len > 0 && events[heap[0]].when <= now) {
+		int ev;
+
+		ev = heap[0];
+		heap_remove(0);
+		DEBUG(TRACE_MISC, "sched: event %d at %zu\n", ev, now);
+		if (events[ev].fn)
+			events[ev].fn();
+	}
+
+	update_next();
+}
+
+// Events posted by the modules' init functions, but not pending in
+// the snapshot, are run right away.
+void
+sched_snapshot(struct snapshot *s)
+{
+	for (int ev = 0; ev < SCHED_EVENTS; ev++) {
+		uint8_t pending;
+		uint64_t when;
+
+		pending = events[ev].slot != 0;
+		when = events[ev].when;
+		SNAP(s, pending);
+		SNAP(s, when);
+
+		if (s->restore) {
+			if (pending)
+				sched_at(ev, when);
+			else if (events[ev].slot)
+				sched_at(ev, ucode_cycles());
+		}
+	}
+}
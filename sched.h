@@ -0,0 +1,36 @@
+#ifndef USIM_SCHED_H
+#define USIM_SCHED_H
+
+#include <stddef.h>
+
+// Device events, each of which is either pending at some cycle or
+// idle.
+enum {
+	SCHED_DISK,		// Disk command completion interrupt.
+	SCHED_TV,		// Screen updates and input to and from X11.
+	SCHED_TV_60HZ,		// 60 Hz TV interrupt.
+	SCHED_KBD,		// Keyboard queue dequeue.
+	SCHED_CHAOS,		// Chaosnet receive.
+	SCHED_IDLE,		// Idle detection.
+	SCHED_PROF,		// Microcode profiler sample.
+	SCHED_REPORT,		// Profiler and statistics reports.
+	SCHED_SNAPSHOT,		// Machine snapshot.
+	SCHED_EVENTS
+};
+
+// Cycle of the earliest pending event; the microcode loop calls
+// sched_run() once the cycle counter reaches it.
+extern volatile size_t sched_next;
+
+extern void sched_handler(int ev, void (*fn)(void));
+extern void sched_at(int ev, size_t when);
+extern void sched_after(int ev, size_t delay);
+extern void sched_cancel(int ev);
+extern int sched_pending(int ev);
+extern void sched_async(int ev);
+extern void sched_run(size_t now);
+
+struct snapshot;
+extern void sched_snapshot(struct snapshot *s);
+
+#endif
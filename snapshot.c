@@ -0,0 +1,195 @@
+// snapshot.c --- complete machine snapshots
+//
+// A snapshot holds the processor, memory and device state, so that
+// usim can resume a running Lisp Machine instead of booting it.  The
+// file starts with a header:
+//
+//	char magic[8];		"USIMSNAP"
+//	uint32_t version;	SNAPSHOT_VERSION
+//	uint32_t byte_order;	0x01020304, in host order
+//
+// followed by one section per module, in the order of SECTIONS:
+//
+//	char tag[4];
+//	uint32_t length;	Bytes of data following.
+//
+// The disk images are not part of the snapshot; resume with the same
+// images, untouched since the snapshot was taken.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "usim.h"
+#include "utrace.h"
+#include "ucode.h"
+#include "mem.h"
+#include "sched.h"
+#include "disk.h"
+#include "chaos.h"
+#include "kbd.h"
+#include "mouse.h"
+#include "iob.h"
+#include "tv.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "USIMSNAP"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+// Processor state comes first, as restoring the other modules may
+// depend on the cycle counter.
+static struct {
+	char tag[5];
+	void (*fn)(struct snapshot *s);
+} sections[] = {
+	{"CPU ", ucode_snapshot},
+	{"MEM ", mem_snapshot},
+	{"SCHD", sched_snapshot},
+	{"DISK", disk_snapshot},
+	{"CHAO", chaos_snapshot},
+	{"KBD ", kbd_snapshot},
+	{"MOUS", mouse_snapshot},
+	{"IOB ", iob_snapshot},
+	{"TV  ", tv_snapshot},
+};
+
+// Write or read N bytes at P, depending on the direction of S.
+void
+snap_io(struct snapshot *s, void *p, size_t n)
+{
+	if (s->error)
+		return;
+
+	if (s->restore) {
+		if (fread(p, n, 1, s->f) != 1)
+			s->error = true;
+	} else {
+		if (fwrite(p, n, 1, s->f) != 1)
+			s->error = true;
+	}
+}
+
+int
+snapshot_save(char *fn)
+{
+	struct snapshot s;
+	uint32_t version;
+	uint32_t byte_order;
+
+	// Memory must not change under a disk transfer while it is saved.
+	disk_drain();
+
+	s.f = fopen(fn, "w");
+	if (s.f == NULL) {
+		WARNING(TRACE_MISC, "snapshot: can't create %s\n", fn);
+		return -1;
+	}
+	s.restore = false;
+	s.error = false;
+
+	version = SNAPSHOT_VERSION;
+	byte_order = SNAPSHOT_BYTE_ORDER;
+	snap_io(&s, SNAPSHOT_MAGIC, 8);
+	SNAP(&s, version);
+	SNAP(&s, byte_order);
+
+	for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+		uint32_t length;
+		long start;
+		long end;
+
+		// The length is filled in once the section is written.
+		length = 0;
+		snap_io(&s, sections[i].tag, 4);
+		SNAP(&s, length);
+		start = ftell(s.f);
+
+		sections[i].fn(&s);
+
+		end = ftell(s.f);
+		length = end - start;
+		if (fseek(s.f, start - sizeof(length), SEEK_SET) < 0)
+			s.error = true;
+		SNAP(&s, length);
+		if (fseek(s.f, end, SEEK_SET) < 0)
+			s.error = true;
+	}
+
+	if (fclose(s.f) != 0)
+		s.error = true;
+
+	if (s.error) {
+		WARNING(TRACE_MISC, "snapshot: error writing %s\n", fn);
+		return -1;
+	}
+
+	NOTICE(TRACE_MISC, "snapshot: saved %s at cycle %zu\n", fn, ucode_cycles());
+
+	return 0;
+}
+
+int
+snapshot_restore(char *fn)
+{
+	struct snapshot s;
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+
+	s.f = fopen(fn, "r");
+	if (s.f == NULL) {
+		WARNING(TRACE_MISC, "snapshot: can't open %s\n", fn);
+		return -1;
+	}
+	s.restore = true;
+	s.error = false;
+
+	snap_io(&s, magic, 8);
+	SNAP(&s, version);
+	SNAP(&s, byte_order);
+
+	if (s.error || memcmp(magic, SNAPSHOT_MAGIC, 8) != 0) {
+		WARNING(TRACE_MISC, "snapshot: %s is not a snapshot\n", fn);
+		fclose(s.f);
+		return -1;
+	}
+
+	if (version != SNAPSHOT_VERSION || byte_order != SNAPSHOT_BYTE_ORDER) {
+		WARNING(TRACE_MISC, "snapshot: %s has version %u, expected %u on this host\n", fn, version, SNAPSHOT_VERSION);
+		fclose(s.f);
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]) && !s.error; i++) {
+		char tag[4];
+		uint32_t length;
+		long start;
+
+		snap_io(&s, tag, 4);
+		SNAP(&s, length);
+		if (s.error || memcmp(tag, sections[i].tag, 4) != 0) {
+			WARNING(TRACE_MISC, "snapshot: expected section %s in %s\n", sections[i].tag, fn);
+			s.error = true;
+			break;
+		}
+
+		start = ftell(s.f);
+		sections[i].fn(&s);
+		if (ftell(s.f) - start != length) {
+			WARNING(TRACE_MISC, "snapshot: section %s in %s has the wrong size\n", sections[i].tag, fn);
+			s.error = true;
+		}
+	}
+
+	fclose(s.f);
+
+	if (s.error) {
+		WARNING(TRACE_MISC, "snapshot: error reading %s\n", fn);
+		return -1;
+	}
+
+	NOTICE(TRACE_MISC, "snapshot: resumed %s at cycle %zu\n", fn, ucode_cycles());
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef USIM_SNAPSHOT_H
+#define USIM_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// A snapshot being written or read.  Each module describes its state
+// once, in a function that calls SNAP() on every variable; the same
+// function serves for saving and restoring.
+struct snapshot {
+	FILE *f;
+	bool restore;
+	bool error;
+};
+
+extern void snap_io(struct snapshot *s, void *p, size_t n);
+
+#define SNAP(s, v) snap_io(s, &(v), sizeof(v))
+
+extern int snapshot_save(char *fn);
+extern int snapshot_restore(char *fn);
+
+#endif
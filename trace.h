@@ -1,6 +1,8 @@
 #ifndef USIM_TRACE_H
 #define USIM_TRACE_H
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <syslog.h>
 
 #define TRACE_NONE	0	// 0000_0000
@@ -17,13 +19,32 @@ extern int trace_fd;
 
 extern void trace(int facility, int prio, const char *fmt, ...);
 
-#define EMERG(facility, args...)	trace(facility, LOG_EMERG, args)
-#define ALERT(facility, args...)	trace(facility, LOG_ALERT, args)
-#define CRIT(facility, args...)		trace(facility, LOG_CRIT, args)
-#define ERR(facility, args...)		trace(facility, LOG_ERR, args)
-#define WARNING(facility, args...)	trace(facility, LOG_WARNING, args)
-#define NOTICE(facility, args...)	trace(facility, LOG_NOTICE, args)
-#define INFO(facility, args...)		trace(facility, LOG_INFO, args)
-#define DEBUG(facility, args...)	trace(facility, LOG_DEBUG, args)
+// Trace sites above this priority are compiled out, e.g. build with
+// -DTRACE_MAX_LEVEL=LOG_NOTICE to drop all DEBUG and INFO calls.
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL LOG_DEBUG
+#endif
+
+static inline bool
+trace_enabled(int facility, int prio)
+{
+	return prio <= TRACE_MAX_LEVEL && trace_level >= prio && (trace_facilities & facility);
+}
+
+// Arguments are only evaluated if the trace site is enabled.
+#define TRACE(facility, prio, args...)				\
+	do {							\
+		if (trace_enabled(facility, prio))		\
+			trace(facility, prio, args);		\
+	} while (0)
+
+#define EMERG(facility, args...)	TRACE(facility, LOG_EMERG, args)
+#define ALERT(facility, args...)	TRACE(facility, LOG_ALERT, args)
+#define CRIT(facility, args...)		TRACE(facility, LOG_CRIT, args)
+#define ERR(facility, args...)		TRACE(facility, LOG_ERR, args)
+#define WARNING(facility, args...)	TRACE(facility, LOG_WARNING, args)
+#define NOTICE(facility, args...)	TRACE(facility, LOG_NOTICE, args)
+#define INFO(facility, args...)		TRACE(facility, LOG_INFO, args)
+#define DEBUG(facility, args...)	TRACE(facility, LOG_DEBUG, args)
 
 #endif
@@ -1,25 +1,38 @@
 // tv.c --- TV interface
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <err.h>
 
 #include "usim.h"
+#include "ucfg.h"
 #include "utrace.h"
 #include "ucode.h"
 
+#include "mem.h"
+#include "tv.h"
 #include "x11.h"
+#include "sched.h"
+#include "idle.h"
+#include "snapshot.h"
 
-#define Black 0x000000
-#define White 0xffffff
+#include "misc.h"
 
 uint32_t tv_width = 768;
 uint32_t tv_height = 897;
 
-uint32_t tv_bitmap[(768 * 1024)];
+// TV memory, one bit per pixel as the microcode sees it; the display
+// backend expands it to its own pixel format when refreshing.
+uint32_t tv_fb[TV_FB_WORDS];
 
 static int tv_csr;
 
+// False when running without a display; the TV memory is then only
+// seen through tv_dump().
+static bool tv_x11;
+
 static void
 tv_post_60hz_interrupt(void)
 {
@@ -30,81 +43,175 @@ tv_post_60hz_interrupt(void)
 static void
 sigalrm_handler(int arg)
 {
-	tv_post_60hz_interrupt();
+	sched_async(SCHED_TV_60HZ);
 }
 
 void
 tv_read(uint32_t offset, uint32_t *pv)
 {
-	unsigned long bits;
-
-	offset *= 32;
-
-	if (offset > tv_width * tv_height) {
-		WARNING(TRACE_MISC, "tv: tv_read past end; offset %o\n", offset);
+	if (offset * 32 > tv_width * tv_height) {
+		WARNING(TRACE_MISC, "tv: tv_read past end; offset %o\n", offset * 32);
 		*pv = 0;
 		return;
 	}
 
-	bits = 0;
-	for (int i = 0; i < 32; i++) {
-		if (tv_bitmap[offset + i] == Black)
-			bits |= 1UL << i;
-	}
-
-	*pv = bits;
+	*pv = tv_fb[offset];
 }
 
 void
 tv_write(uint32_t offset, uint32_t bits)
 {
-	int h;
-	int v;
+	if (offset >= TV_FB_WORDS)
+		return;
 
-	offset *= 32;
+	// The scheduler keeps rewriting the run light with the same
+	// value while the machine waits; that isn't activity.
+	if (tv_fb[offset] == bits)
+		return;
+	tv_fb[offset] = bits;
 
-	v = offset / tv_width;
-	h = offset % tv_width;
+	if (tv_x11 && offset < tv_width * tv_height / 32)
+		accumulate_update(offset * 32 % tv_width, offset * 32 / tv_width, 32, 1);
+	idle_busy = true;
+}
 
-	for (int i = 0; i < 32; i++) {
-		tv_bitmap[offset + i] = (bits & 1) ? Black : White;
-		bits >>= 1;
+static void
+tv_fb_read(uint32_t vaddr, int offset, uint32_t *pv)
+{
+	(void) offset;
+	// Inhibit color probe.
+	if ((vaddr & 077700000) == 077200000) {
+		*pv = 0;
+		return;
 	}
+	tv_read(vaddr & 077777, pv);
+}
 
-	accumulate_update(h, v, 32, 1);
+static void
+tv_fb_write(uint32_t vaddr, int offset, uint32_t v)
+{
+	(void) offset;
+	// Inhibit color probe.
+	if ((vaddr & 077700000) == 077200000)
+		return;
+	tv_write(vaddr & 077777, v);
 }
 
-void
-tv_xbus_read(uint32_t offset, uint32_t *pv)
+static void
+tv_xbus_read(uint32_t vaddr, int offset, uint32_t *pv)
 {
+	(void) vaddr;
+	(void) offset;
 	*pv = tv_csr;
 }
 
-void
-tv_xbus_write(uint32_t offset, uint32_t v)
+static void
+tv_xbus_write(uint32_t vaddr, int offset, uint32_t v)
 {
+	(void) vaddr;
+	(void) offset;
 	tv_csr = v;
 	tv_csr &= ~(1 << 4);
 	deassert_xbus_interrupt();
 }
 
-void
+static void
+tv_reg_write(uint32_t vaddr, int offset, uint32_t v)
+{
+	DEBUG(TRACE_MISC, "tv: reg write %o, offset %o, v %o\n", vaddr, offset, v);
+}
+
+#define TV_POLL_CYCLES 0x10000
+
+static void
 tv_poll(void)
 {
 	x11_event();
+	sched_after(SCHED_TV, TV_POLL_CYCLES);
+}
+
+// Write the screen to FN as a binary PBM image.  PBM has the leftmost
+// pixel in the high bit and 1 for black, like the TV memory but with
+// the bits of each byte reversed.
+static void
+tv_dump_pbm(char *fn)
+{
+	FILE *f;
+
+	f = fopen(fn, "w");
+	if (f == NULL) {
+		warn("tv: %s", fn);
+		return;
+	}
+
+	fprintf(f, "P4\n%u %u\n", tv_width, tv_height);
+	for (uint32_t offset = 0; offset < tv_width * tv_height / 32; offset++) {
+		for (int i = 0; i < 4; i++) {
+			uint8_t b;
+
+			b = tv_fb[offset] >> (8 * i);
+			b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+			b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+			b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+			putc(b, f);
+		}
+	}
+	fclose(f);
+
+	NOTICE(TRACE_MISC, "tv: wrote %s\n", fn);
+}
+
+// Write the screen, if configured.
+void
+tv_dump(void)
+{
+	if (ucfg.tv_dump_filename)
+		tv_dump_pbm(ucfg.tv_dump_filename);
+}
+
+// The screen is saved one bit per pixel, as the microcode sees it.
+void
+tv_snapshot(struct snapshot *s)
+{
+	SNAP(s, tv_csr);
+
+	for (uint32_t offset = 0; offset < tv_width * tv_height / 32; offset++) {
+		uint32_t bits;
+
+		if (!s->restore)
+			tv_read(offset, &bits);
+		SNAP(s, bits);
+		if (s->restore)
+			tv_write(offset, bits);
+	}
 }
 
 void
 tv_init(void)
 {
-	x11_init();
+	if (streq(ucfg.tv_display, "x11"))
+		tv_x11 = true;
+	else if (!streq(ucfg.tv_display, "none"))
+		errx(1, "tv: display must be x11 or none: %s", ucfg.tv_display);
+
+	if (tv_x11) {
+		x11_init();
+		sched_handler(SCHED_TV, tv_poll);
+		sched_at(SCHED_TV, 0);
+	}
+	sched_handler(SCHED_TV_60HZ, tv_post_60hz_interrupt);
+
+	if (ucfg.tv_dump_filename)
+		atexit(tv_dump);
+
+	io_register(036000, 0, 0377, tv_fb_read, tv_fb_write);
+	io_register(036777, 0360, 0360, tv_xbus_read, tv_xbus_write);
+	io_register(037760, 0, 0377, NULL, tv_reg_write);
 
 	{
 		struct itimerval itimer;
 		int usecs;
 
-		signal(SIGVTALRM, sigalrm_handler);
-
 		usecs = 16000;
 
 		itimer.it_interval.tv_sec = 0;
@@ -112,6 +219,14 @@ tv_init(void)
 		itimer.it_value.tv_sec = 0;
 		itimer.it_value.tv_usec = usecs;
 
-		setitimer(ITIMER_VIRTUAL, &itimer, 0);
+		// CPU time stops while sleeping, so the clock has to
+		// follow real time once the host may sleep.
+		if (idle_sleep_flag) {
+			signal(SIGALRM, sigalrm_handler);
+			setitimer(ITIMER_REAL, &itimer, 0);
+		} else {
+			signal(SIGVTALRM, sigalrm_handler);
+			setitimer(ITIMER_VIRTUAL, &itimer, 0);
+		}
 	}
 }
@@ -12,6 +12,7 @@
 #include "utrace.h"
 #include "kbd.h"
 #include "chaos.h"
+#include "mem.h"
 
 #include "misc.h"
 
@@ -44,6 +45,29 @@ ucfg_handler(void *user, const char *section, const char *name, const char *valu
 		chaos_set_addr(addr);
 	}
 
+	if (INIHEQ("memory", "pages")) {
+		long pages;
+		char *end;
+
+		pages = strtol(value, &end, 0);
+		if (*end != 0 || pages < 1 || pages > PHYS_RAM_PAGES_MAX)
+			errx(1, "memory pages must be between 1 and %d", PHYS_RAM_PAGES_MAX);
+		phys_ram_pages = pages;
+	}
+
+	if (INIHEQ("ucode", "engine")) {
+		if (!streq(cfg->ucode_engine, "switch") &&
+		    !streq(cfg->ucode_engine, "threaded") &&
+		    !streq(cfg->ucode_engine, "block"))
+			warnx("unknown microcode engine: %s", cfg->ucode_engine);
+	}
+
+	if (INIHEQ("idle", "sleep")) {
+		if (!streq(cfg->idle_sleep, "yes") &&
+		    !streq(cfg->idle_sleep, "no"))
+			warnx("idle sleep must be yes or no: %s", cfg->idle_sleep);
+	}
+
 	if (INIHEQ("trace", "level")) {
 		     if (streq(cfg->trace_level, "alert"))   trace_level = LOG_ALERT;
 		else if (streq(cfg->trace_level, "crit"))    trace_level = LOG_CRIT;
@@ -21,8 +21,10 @@
 #include "mem.h"
 #include "iob.h"
 #include "tv.h"
-#include "chaos.h"
 #include "disk.h"
+#include "sched.h"
+#include "prof.h"
+#include "snapshot.h"
 
 #include "misc.h"
 #include "syms.h"
@@ -34,9 +36,74 @@ ucw_t prom_ucode[512];
 static ucw_t ucode[16 * 1024];
 static uint32_t dispatch_memory[2048];
 
+// Predecoded microinstruction.  Each location in PROM_UCODE and
+// UCODE has a record which is filled in the first time the location
+// is fetched, and invalidated when the location is rewritten.
+struct udecode {
+	ucw_t u;
+	bool valid;
+	bool nop;
+	uint8_t op_code;
+	uint8_t popj;
+	uint16_t a_src;
+	uint8_t m_src;
+	uint8_t misc;		// Misc. function.
+	uint8_t pos;		// Rotation / byte position.
+	uint16_t dest;		// ALU, BYTE.
+	uint8_t out_bus;	// ALU.
+	uint8_t carry_in;	// ALU.
+	uint8_t aluop;		// ALU.
+	uint8_t q_control;	// ALU.
+	uint16_t new_pc;	// JUMP.
+	uint8_t r_bit;		// JUMP.
+	uint8_t p_bit;		// JUMP.
+	uint8_t n_bit;		// JUMP.
+	uint8_t invert_sense;	// JUMP.
+	uint8_t cond_test;	// JUMP, test condition instead of bit.
+	uint8_t cond;		// JUMP.
+	uint16_t disp_const;	// DISPATCH.
+	uint16_t disp_addr;	// DISPATCH.
+	uint8_t n_plus1;	// DISPATCH.
+	uint8_t enable_ish;	// DISPATCH.
+	uint8_t map;		// DISPATCH.
+	uint8_t len;		// DISPATCH.
+	uint8_t mr_sr_bits;	// BYTE.
+	uint8_t widthm1;	// BYTE.
+	uint8_t dest_kind;	// ALU, BYTE; see DEST_xxx.
+};
+
+#define DEST_M 0		// M memory only.
+#define DEST_A 1		// A memory.
+#define DEST_FUNC 2		// Functional destination (and M memory).
+
+static struct udecode prom_decoded[512];
+static struct udecode ucode_decoded[16 * 1024];
+
+static struct udecode nop_decoded;		// Empty pipeline.
+static struct udecode dispatch_jump_decoded;	// Jump taken by DISPATCH.
+static struct udecode oa_decoded;		// OA-modified instruction.
+static struct udecode held_decoded[2];		// Fetched, then rewritten.
+
+// Straight-line run of RAM microinstructions starting at some
+// location in UCODE; see run_blocks().
+struct ublock {
+	bool valid;
+	uint8_t hits;		// Entries while not yet translated.
+	uint16_t len;		// Instructions in the run; 0 if too short.
+	uint16_t native_len;	// Leading instructions run by NATIVE.
+	void (*native)(void);	// Host code, or NULL; see ucode_jit.h.
+};
+
+#define BLOCK_MAX 64		// Longest run translated.
+#define BLOCK_HOT 16		// Entries before a run is translated.
+
+static struct ublock ucode_blocks[16 * 1024];
+static bool block_flag;
+
 static size_t cycles;
 
 static int u_pc;
+static int exec_pc;		// Location being executed, when profiling.
 
 static int page_fault_flag;
 static int interrupt_pending_flag;
@@ -160,8 +227,9 @@ deassert_xbus_interrupt(void)
 // ---!!! read_mem, write_mem: Document each address.
 
 static void
-unibus_read(int offset, uint32_t *pv)
+unibus_read(uint32_t vaddr, int offset, uint32_t *pv)
 {
+	(void) vaddr;
 	switch (offset) {
 	case 040:
 		DEBUG(TRACE_IOB, "unibus: read interrupt status\n");
@@ -181,18 +249,25 @@ unibus_read(int offset, uint32_t *pv)
 static int
 read_mem(int vaddr, uint32_t *pv)
 {
+	struct tlb_entry *e;
 	uint32_t map;
 	int pn;
 	int offset;
-	struct page_s *page;
 
 	access_fault_bit = 0;
 	write_fault_bit = 0;
 	page_fault_flag = 0;
 
+	e = tlb_lookup(vaddr);
+	if (e->read) {
+		*pv = e->read->w[vaddr & 0377];
+		return 0;
+	}
+
 	// 14 bit page number.
-	map = map_vtop(vaddr, (int *) 0, &offset);
+	map = e->map;
 	pn = map & 037777;
+	offset = vaddr & 0377;
 
 	if ((map & (1 << 23)) == 0) {
 		// No access permission.
@@ -204,66 +279,27 @@ read_mem(int vaddr, uint32_t *pv)
 		return -1;
 	}
 
-	page = phy_pages[pn];
-	if (pn < 020000 && page) {
-		*pv = page->w[offset];
-		return 0;
-	}
-
-	// Simulate fixed number of RAM pages (< 2MW?).
-	if (pn >= phys_ram_pages && pn <= 035777) {
+	// Non-existent memory between the end of RAM and the XBUS
+	// I/O space.
+	if (pn >= phys_ram_pages && pn < PHYS_RAM_PAGES_MAX) {
 		*pv = 0xffffffff;
 		return 0;
 	}
 
-	switch (pn) {
-	case 036000:
-		// Inhibit color probe.
-		if ((vaddr & 077700000) == 077200000) {
-			*pv = 0x0;
-			return 0;
-		}
-		offset = vaddr & 077777;
-		tv_read(offset, pv);
-		return 0;
-	case 037764:		// Extra xbus devices.
-		offset <<= 1;
-		iob_unibus_read(offset, (int *) pv);
-		return 0;
-	case 037766:		// Unibus.
-		unibus_read(offset, pv);
+	if (io_read(pn, vaddr, offset, pv))
 		return 0;
-	case 036777:		      // Disk & TV controller on XBUS.
-		if (offset >= 0370) { // Disk.
-			disk_xbus_read(offset, pv);
-			return 0;
-		}
-		if (offset == 0360) { // TV.
-			tv_xbus_read(offset, pv);
-			return 0;
-		}
-		DEBUG(TRACE_MISC, "xbus read %o %o\n", offset, vaddr);
-		*pv = 0;
-		return 0;
-	}
 
-	// Page fault.
-	page = phy_pages[pn];
-	if (page == 0) {
-		page_fault_flag = 1;
-		opc = pn;
-		DEBUG(TRACE_MISC, "read_mem(vaddr=%o) page fault\n", vaddr);
-		*pv = 0;
-		return -1;
-	}
-
-	*pv = page->w[offset];
+	// XBUS page that no device claims.
+	*pv = phy_mem[pn].w[offset];
 	return 0;
 }
 
 static void
-unibus_write(int offset, uint32_t v)
+unibus_write(uint32_t vaddr, int offset, uint32_t v)
 {
+	(void) vaddr;
+	offset <<= 1;
+
 	switch (offset) {
 	case 012:
 		DEBUG(TRACE_IOB, "unibus: write mode register %o\n", v);
@@ -305,18 +341,25 @@ unibus_write(int offset, uint32_t v)
 static int
 write_mem(int vaddr, uint32_t v)
 {
+	struct tlb_entry *e;
 	uint32_t map;
 	int pn;
 	int offset;
-	struct page_s *page;
 
 	write_fault_bit = 0;
 	access_fault_bit = 0;
 	page_fault_flag = 0;
 
+	e = tlb_lookup(vaddr);
+	if (e->write) {
+		e->write->w[vaddr & 0377] = v;
+		return 0;
+	}
+
 	// 14 bit page number.
-	map = map_vtop(vaddr, (int *) 0, &offset);
+	map = e->map;
 	pn = map & 037777;
+	offset = vaddr & 0377;
 
 	if ((map & (1 << 23)) == 0) {
 		// No access permission.
@@ -336,59 +379,16 @@ write_mem(int vaddr, uint32_t v)
 		return -1;
 	}
 
-	page = phy_pages[pn];
-	if (pn < 020000 && page) {
-		page->w[offset] = v;
+	if (pn >= PHYS_RAM_PAGES_MAX && io_write(pn, vaddr, offset, v))
 		return 0;
-	}
-
-	switch (pn) {
-	case 036000:
-		// Inhibit color probe.
-		if ((vaddr & 077700000) == 077200000) {
-			return 0;
-		}
-		offset = vaddr & 077777;
-		tv_write(offset, v);
-		return 0;
-	case 037760:
-		DEBUG(TRACE_MISC, "tv: reg write %o, offset %o, v %o\n", vaddr, offset, v);
-		return 0;
-	case 037764:		// Extra xbus devices.
-		offset <<= 1;
-		DEBUG(TRACE_IOB, "unibus: iob v %o, offset %o\n", vaddr, offset);
-		iob_unibus_write(offset, v);
-		return 0;
-	case 037766:		// Unibus.
-		offset <<= 1;
-		unibus_write(offset, v);
-		return 0;
-	case 036777:		// Disk & TV controller on XBUS.
-		if (offset >= 0370) {
-			disk_xbus_write(offset, v);
-			return 0;
-		}
-		if (offset == 0360) {
-			tv_xbus_write(offset, v);
-			return 0;
-		}
-		return 0;
-	}
 
 	// Catch questionable accesses.
 	if (pn >= 036000) {
 		DEBUG(TRACE_MISC, "??: reg write vaddr %o, pn %o, offset %o, v %o; u_pc %o\n", vaddr, pn, offset, v, u_pc);
 	}
 
-	page = phy_pages[pn];
-	if (page == 0) {
-		// Page fault.
-		page_fault_flag = 1;
-		opc = pn;
-		return -1;
-	}
-
-	page->w[offset] = v;
+	// Past the end of RAM, or an XBUS page that no device claims.
+	phy_mem[pn].w[offset] = v;
 	return 0;
 }
 
@@ -466,12 +466,15 @@ write_pdl_mem(int which, uint32_t v)
 
 static int spc_stack[32];
 static int spc_stack_ptr;
+static int spc_depth;		// Valid entries, for backtraces.
 
 static void
 push_spc(int pc)
 {
 	spc_stack_ptr = (spc_stack_ptr + 1) & 037;
 	spc_stack[spc_stack_ptr] = pc;
+	if (spc_depth < 32)
+		spc_depth++;
 }
 
 static int
@@ -481,8 +484,31 @@ pop_spc(void)
 
 	v = spc_stack[spc_stack_ptr];
 	spc_stack_ptr = (spc_stack_ptr - 1) & 037;
+	if (spc_depth > 0)
+		spc_depth--;
 	return v;
 }
+
+// Fill PCS with the return addresses on the SPC stack, outermost
+// first, followed by the location being executed.  Returns the
+// number of entries.
+int
+ucode_backtrace(int *pcs, int max)
+{
+	int depth;
+	int n;
+
+	if (prom_enabled_flag || max < 1)
+		return 0;
+
+	depth = spc_depth < max - 1 ? spc_depth : max - 1;
+	n = 0;
+	for (int i = depth - 1; i >= 0; i--)
+		pcs[n++] = spc_stack[(spc_stack_ptr - i) & 037] & 037777;
+	pcs[n++] = exec_pc;
+
+	return n;
+}
 
 static int lc;
 static int lc_byte_mode_flag;
@@ -496,6 +522,9 @@ advance_lc(int *ppc)
 
 	old_lc = lc & 0377777777; // LC is 26 bits.
 
+	if (prof_macro_flag)
+		prof_macro(old_lc);
+
 	if (lc_byte_mode_flag) {
 		lc++;		// Byte mode.
 	} else {
@@ -664,7 +693,6 @@ write_dest(int dest, uint32_t out_bus)
 			l2_map[l2_index] = l2_data;
 			invalidate_vtop_cache();
 			DEBUG(TRACE_VM, "l2_map[%o] <- %o\n", l2_index, l2_data);
-			add_new_page_no(l2_data & 037777);
 		}
 		break;
 	case 030:		// MD register (memory data).
@@ -720,22 +748,309 @@ rotate_left(uint32_t value, int bitstorotate)
 	return (value << bitstorotate) | tmp;
 }
 
+// Number of microcycles run so far.
+size_t
+ucode_cycles(void)
+{
+	return cycles;
+}
+
+bool
+ucode_interrupts_enabled(void)
+{
+	return interrupt_enable_flag;
+}
+
+// Split microinstruction U into its fields.
+static void
+ucode_decode(ucw_t u, struct udecode *d)
+{
+	d->u = u;
+	d->valid = true;
+	d->nop = (u & NOP_MASK) == 0;
+
+	d->op_code = (u >> 43) & 03;
+	d->popj = (u >> 42) & 1;
+	d->a_src = (u >> 32) & 01777;
+	d->m_src = (u >> 26) & 077;
+	d->misc = (u >> 10) & 3;
+	d->pos = u & 037;
+
+	d->dest = (u >> 14) & 07777;
+	d->out_bus = (u >> 12) & 3;
+	d->carry_in = (u >> 2) & 1;
+	d->aluop = (u >> 3) & 077;
+	d->q_control = u & 3;
+
+	d->new_pc = (u >> 12) & 037777;
+	d->r_bit = (u >> 9) & 1;
+	d->p_bit = (u >> 8) & 1;
+	d->n_bit = (u >> 7) & 1;
+	d->invert_sense = (u >> 6) & 1;
+	d->cond_test = (u >> 5) & 1;
+	d->cond = u & 017;
+
+	d->disp_const = (u >> 32) & 01777;
+	d->n_plus1 = (u >> 25) & 1;
+	d->enable_ish = (u >> 24) & 1;
+	d->disp_addr = (u >> 12) & 03777;
+	d->map = (u >> 8) & 3;
+	d->len = (u >> 5) & 07;
+
+	d->mr_sr_bits = (u >> 12) & 3;
+	d->widthm1 = (u >> 5) & 037;
+
+	if (d->dest & 04000)
+		d->dest_kind = DEST_A;
+	else if (d->dest >> 5)
+		d->dest_kind = DEST_FUNC;
+	else
+		d->dest_kind = DEST_M;
+}
+
+// Fetch next instruction from PROM or RAM.
+static inline struct udecode *
+fetch_decoded(int pc)
+{
+	struct udecode *d;
+
+	if (prom_enabled_flag) {
+		d = &prom_decoded[pc & 0777];
+		if (!d->valid)
+			ucode_decode(prom_ucode[pc & 0777], d);
+	} else {
+		pc &= 037777;
+		d = &ucode_decoded[pc];
+		if (!d->valid)
+			ucode_decode(ucode[pc], d);
+	}
+
+	return d;
+}
+
+#include "ucode_jit.h"
+
+// True if D may execute inside a block: it neither transfers
+// control, modifies the next instruction, nor starts a memory cycle.
+static bool
+block_insn_ok(struct udecode *d)
+{
+	if (d->nop)
+		return true;
+
+	if (d->op_code == 1 || d->op_code == 2 || d->popj)
+		return false;
+
+	if (d->dest_kind == DEST_FUNC) {
+		switch (d->dest >> 5) {
+		case 016:
+		case 017:
+		case 021:
+		case 022:
+		case 023:
+		case 031:
+		case 032:
+		case 033:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Translate the run of straight-line microcode starting at PC.
+static void
+block_translate(int pc)
+{
+	struct ublock *b;
+	int len;
+
+	b = &ucode_blocks[pc];
+	for (len = 0; len < BLOCK_MAX && pc + len < 16 * 1024; len++) {
+		struct udecode *d;
+
+		d = &ucode_decoded[pc + len];
+		if (!d->valid)
+			ucode_decode(ucode[pc + len], d);
+		if (!block_insn_ok(d))
+			break;
+	}
+
+	b->valid = true;
+	b->len = len < 2 ? 0 : len;
+	b->native = NULL;
+	b->native_len = 0;
+	DEBUG(TRACE_MISC, "block %o, len %d\n", pc, b->len);
+
+	if (b->len)
+		jit_translate(b, pc);
+}
+
+// Drop every block that covers PC.
+static void
+block_invalidate(int pc)
+{
+	for (int i = pc < BLOCK_MAX ? 0 : pc - BLOCK_MAX + 1; i <= pc; i++) {
+		ucode_blocks[i].valid = false;
+		ucode_blocks[i].hits = 0;
+	}
+}
+
+// Pipeline as of the last scheduler call.  The interpreter loops
+// keep it in locals, and hand it over here so that a snapshot taken
+// by an event sees it.
+static struct udecode *snap_p1;
+static ucw_t snap_p1_u;
+static int snap_p1_pc;
+static int snap_u_pc;
+static char snap_no_exec_next;
+static bool resumed;
+
+static void __attribute__((noinline))
+ucode_sched_run(struct udecode *p1, int p1_pc, int pc, char no_exec_next)
+{
+	snap_p1 = p1;
+	snap_p1_pc = p1_pc;
+	snap_u_pc = pc;
+	snap_no_exec_next = no_exec_next;
+
+	sched_run(cycles);
+}
+
+// Set up the pipeline from a restored snapshot.  Returns false if
+// there is none, i.e. on a cold start.
+static bool
+pipeline_resume(struct udecode **p1, int *p1_pc, char *no_exec_next)
+{
+	struct udecode *d;
+
+	if (!resumed)
+		return false;
+	resumed = false;
+
+	u_pc = snap_u_pc;
+	*p1_pc = snap_p1_pc;
+	*no_exec_next = snap_no_exec_next;
+
+	d = fetch_decoded(snap_p1_pc);
+	if (d->u != snap_p1_u) {
+		// Fetched before the location was rewritten.
+		ucode_decode(snap_p1_u, &held_decoded[0]);
+		d = &held_decoded[0];
+	}
+	*p1 = d;
+
+	return true;
+}
+
 void
-run(void)
+ucode_init(void)
+{
+	io_register(037766, 0, 0377, unibus_read, unibus_write);
+}
+
+void
+ucode_snapshot(struct snapshot *s)
+{
+	SNAP(s, ucode);
+	SNAP(s, dispatch_memory);
+	SNAP(s, a_memory);
+	SNAP(s, m_memory);
+	SNAP(s, pdl_memory);
+	SNAP(s, pdl_ptr);
+	SNAP(s, pdl_index);
+	SNAP(s, spc_stack);
+	SNAP(s, spc_stack_ptr);
+	SNAP(s, spc_depth);
+
+	SNAP(s, cycles);
+	SNAP(s, prom_enabled_flag);
+	SNAP(s, page_fault_flag);
+	SNAP(s, interrupt_pending_flag);
+	SNAP(s, interrupt_status_reg);
+	SNAP(s, sequence_break_flag);
+	SNAP(s, interrupt_enable_flag);
+	SNAP(s, bus_reset_flag);
+	SNAP(s, interrupt_control);
+	SNAP(s, md);
+	SNAP(s, vma);
+	SNAP(s, q);
+	SNAP(s, opc);
+	SNAP(s, new_md);
+	SNAP(s, new_md_delay);
+	SNAP(s, write_fault_bit);
+	SNAP(s, access_fault_bit);
+	SNAP(s, alu_carry);
+	SNAP(s, alu_out);
+	SNAP(s, oa_reg_lo);
+	SNAP(s, oa_reg_hi);
+	SNAP(s, oa_reg_lo_set);
+	SNAP(s, oa_reg_hi_set);
+	SNAP(s, dispatch_constant);
+	SNAP(s, lc);
+	SNAP(s, lc_byte_mode_flag);
+
+	if (!s->restore)
+		snap_p1_u = snap_p1->u;
+	SNAP(s, snap_p1_u);
+	SNAP(s, snap_p1_pc);
+	SNAP(s, snap_u_pc);
+	SNAP(s, snap_no_exec_next);
+
+	if (s->restore) {
+		for (int i = 0; i < 16 * 1024; i++) {
+			ucode_decoded[i].valid = false;
+			ucode_blocks[i].valid = false;
+			ucode_blocks[i].hits = 0;
+		}
+		resumed = true;
+	}
+}
+
+// Trace sites in the interpreter loops.  These are compiled out of
+// the fast variant of each loop, and the traced variant is only run
+// when microcode tracing is turned on.
+#define UDEBUG(facility, args...)				\
+	do {							\
+		if (traced)					\
+			DEBUG(facility, args);			\
+	} while (0)
+
+#define UWARNING(facility, args...)				\
+	do {							\
+		if (traced)					\
+			WARNING(facility, args);		\
+	} while (0)
+
+static bool
+ucode_traced(void)
+{
+	return trace_enabled(TRACE_MISC, LOG_WARNING);
+}
+
+static inline __attribute__((always_inline)) void
+run_core(const bool traced, const bool profiled)
 {
-	ucw_t p1;
+	struct udecode *p0;
+	struct udecode *p1;
 	int p0_pc;
 	int p1_pc;
 	char no_exec_next;
 
 	u_pc = 0;
 
-	p1 = 0;
+	p1 = &nop_decoded;
 	p0_pc = 0;
 	p1_pc = 0;
 	no_exec_next = 0;
 
-	write_phy_mem(0, 0);
+	if (!nop_decoded.valid) {
+		ucode_decode(0, &nop_decoded);
+		ucode_decode(1 << 5, &dispatch_jump_decoded);
+	}
+
+	if (!pipeline_resume(&p1, &p1_pc, &no_exec_next))
+		write_phy_mem(0, 0);
 
 	while (run_ucode_flag) {
 		char op_code;
@@ -770,9 +1085,8 @@ run(void)
 		int do_sub;
 		uint32_t out_bus;
 		int64_t lv;
-		ucw_t u;
+		struct udecode *d;
 		ucw_t w;
-#define p0 u
 		char n_plus1;
 		char enable_ish;
 		char popj;
@@ -780,18 +1094,14 @@ run(void)
 		m_src_value = 0;
 
 		if (cycles == 0) {
-			p0 = p1 = 0;
+			p0 = p1 = &nop_decoded;
 			p1_pc = 0;
 			no_exec_next = 0;
 		}
 
 	next:
-		iob_poll();
-		disk_poll();
-		if ((cycles & 0x0ffff) == 0) {
-			tv_poll();
-			chaos_poll();
-		}
+		if (cycles >= sched_next)
+			ucode_sched_run(p1, p1_pc, u_pc, no_exec_next);
 
 		// Enforce max. cycles.
 		cycles++;
@@ -799,13 +1109,10 @@ run(void)
 			// Handle overflow.
 			cycles = 1;
 
-		// Fetch next instruction from PROM or RAM.
-#define FETCH() (prom_enabled_flag ? prom_ucode[u_pc] : ucode[u_pc])
-
 		// CPU pipeline.
 		p0 = p1;
 		p0_pc = p1_pc;
-		p1 = FETCH();
+		p1 = fetch_decoded(u_pc);
 		p1_pc = u_pc;
 		u_pc++;
 
@@ -817,38 +1124,54 @@ run(void)
 
 		// Stall pipe for one cycle.
 		if (no_exec_next) {
-			DEBUG(TRACE_MISC, "no_exec_next; u_pc %o\n", u_pc);
+			UDEBUG(TRACE_MISC, "no_exec_next; u_pc %o\n", u_pc);
 			no_exec_next = 0;
 
 			p0 = p1;
 			p0_pc = p1_pc;
 
-			p1 = FETCH();
+			p1 = fetch_decoded(u_pc);
 			p1_pc = u_pc;
 			u_pc++;
 		}
 
-		// Next instruction modify.
-		if (oa_reg_lo_set) {
-			DEBUG(TRACE_MISC, "merging oa lo %o\n", oa_reg_lo);
-			oa_reg_lo_set = 0;
-			u |= oa_reg_lo;
+		d = p0;
+
+		if (profiled && !prom_enabled_flag) {
+			exec_pc = p0_pc & 037777;
+			prof_counts[exec_pc]++;
 		}
 
-		if (oa_reg_hi_set) {
-			DEBUG(TRACE_MISC, "merging oa hi %o\n", oa_reg_hi);
-			oa_reg_hi_set = 0;
-			u |= (ucw_t) oa_reg_hi << 26;
+		// Next instruction modify; the modified instruction is
+		// decoded on the side, leaving the cached copy intact.
+		if (oa_reg_lo_set || oa_reg_hi_set) {
+			ucw_t u;
+
+			u = d->u;
+			if (oa_reg_lo_set) {
+				UDEBUG(TRACE_MISC, "merging oa lo %o\n", oa_reg_lo);
+				oa_reg_lo_set = 0;
+				u |= oa_reg_lo;
+			}
+
+			if (oa_reg_hi_set) {
+				UDEBUG(TRACE_MISC, "merging oa hi %o\n", oa_reg_hi);
+				oa_reg_hi_set = 0;
+				u |= (ucw_t) oa_reg_hi << 26;
+			}
+
+			ucode_decode(u, &oa_decoded);
+			d = &oa_decoded;
 		}
 
 		// NOP short cut.
-		if ((u & NOP_MASK) == 0) {
+		if (d->nop) {
 			goto next;
 		}
 
-		popj = (u >> 42) & 1;
-		a_src = (u >> 32) & 01777;
-		m_src = (u >> 26) & 077;
+		popj = d->popj;
+		a_src = d->a_src;
+		m_src = d->m_src;
 
 		a_src_value = read_a_mem(a_src); // Get A source value.
 
@@ -874,7 +1197,7 @@ run(void)
 				m_src_value = pdl_index & 01777;
 				break;
 			case 5:
-				DEBUG(TRACE_MISC, "reading pdl[%o] -> %o\n", pdl_index, read_pdl_mem(USE_PDL_INDEX));
+				UDEBUG(TRACE_MISC, "reading pdl[%o] -> %o\n", pdl_index, read_pdl_mem(USE_PDL_INDEX));
 				m_src_value = read_pdl_mem(USE_PDL_INDEX);
 				break;
 			case 6:
@@ -887,7 +1210,8 @@ run(void)
 				m_src_value = vma;
 				break;
 			case 011:
-				l2_data = map_vtop(md, (int *) &l1_data, (int *) 0);
+				l2_data = tlb_lookup(md)->map;
+				l1_data = tlb_lookup(md)->l1;
 				m_src_value = ((uint32_t) write_fault_bit << 31) | ((uint32_t) access_fault_bit << 30) | ((l1_data & 037) << 24) | (l2_data & 077777777);
 				break;
 			case 012:
@@ -901,16 +1225,18 @@ run(void)
 				break;
 			case 014:
 				m_src_value = (spc_stack_ptr << 24) | (spc_stack[spc_stack_ptr] & 01777777);
-				DEBUG(TRACE_MISC, "reading spc[%o] + ptr -> %o\n", spc_stack_ptr, m_src_value);
+				UDEBUG(TRACE_MISC, "reading spc[%o] + ptr -> %o\n", spc_stack_ptr, m_src_value);
 				spc_stack_ptr = (spc_stack_ptr - 1) & 037;
+				if (spc_depth > 0)
+					spc_depth--;
 				break;
 			case 024:
-				DEBUG(TRACE_MISC, "reading pdl[%o] -> %o, pop\n", pdl_ptr, read_pdl_mem(USE_PDL_PTR));
+				UDEBUG(TRACE_MISC, "reading pdl[%o] -> %o, pop\n", pdl_ptr, read_pdl_mem(USE_PDL_PTR));
 				m_src_value = read_pdl_mem(USE_PDL_PTR);
 				pdl_ptr = (pdl_ptr - 1) & 01777;
 				break;
 			case 025:
-				DEBUG(TRACE_MISC, "reading pdl[%o] -> %o\n", pdl_ptr, read_pdl_mem(USE_PDL_PTR));
+				UDEBUG(TRACE_MISC, "reading pdl[%o] -> %o\n", pdl_ptr, read_pdl_mem(USE_PDL_PTR));
 				m_src_value = read_pdl_mem(USE_PDL_PTR);
 				break;
 			}
@@ -919,13 +1245,13 @@ run(void)
 		}
 
 		// Decode isntruction.
-		switch (op_code = (u >> 43) & 03) {
+		switch (op_code = d->op_code) {
 		case 0:		// ALU
-			dest = (u >> 14) & 07777;
-			out_bus = (u >> 12) & 3;
-			carry_in = (u >> 2) & 1;
+			dest = d->dest;
+			out_bus = d->out_bus;
+			carry_in = d->carry_in;
 
-			aluop = (u >> 3) & 077;
+			aluop = d->aluop;
 
 			alu_carry = 0;
 
@@ -1068,7 +1394,7 @@ run(void)
 				break;
 			case 041: // Divide step
 				do_sub = q & 1;
-				DEBUG(TRACE_MISC, "do_sub %d\n", do_sub);
+				UDEBUG(TRACE_MISC, "do_sub %d\n", do_sub);
 				if (do_sub) {
 					sub32(m_src_value, a_src_value, !carry_in, alu_out, alu_carry);
 				} else {
@@ -1077,39 +1403,39 @@ run(void)
 				break;
 			case 045: // Remainder correction
 				do_sub = q & 1;
-				DEBUG(TRACE_MISC, "do_sub %d\n", do_sub);
+				UDEBUG(TRACE_MISC, "do_sub %d\n", do_sub);
 				if (do_sub) {
 					alu_carry = 0;
 				} else {
-					add32(alu_out, a_src_value, carry_in, alu_out, alu_carry);
+					add32(alu_out, (uint32_t) a_src_value, carry_in, alu_out, alu_carry);
 				}
 				break;
 			case 051: // Initial divide step
-				DEBUG(TRACE_MISC, "divide-first-step\n");
-				DEBUG(TRACE_MISC, "divide: %o / %o \n", q, a_src_value);
+				UDEBUG(TRACE_MISC, "divide-first-step\n");
+				UDEBUG(TRACE_MISC, "divide: %o / %o \n", q, a_src_value);
 				sub32(m_src_value, a_src_value, !carry_in, alu_out, alu_carry);
-				DEBUG(TRACE_MISC, "alu_out %08x %o %d\n", alu_out, alu_out, alu_out);
+				UDEBUG(TRACE_MISC, "alu_out %08x %o %d\n", alu_out, alu_out, alu_out);
 				break;
 			}
 
 			// Q control.
 			old_q = q;
-			switch (u & 3) {
+			switch (d->q_control) {
 			case 1:
-				DEBUG(TRACE_MISC, "q<<\n");
+				UDEBUG(TRACE_MISC, "q<<\n");
 				q <<= 1;
 				// Inverse of ALU sign.
 				if ((alu_out & 0x80000000) == 0)
 					q |= 1;
 				break;
 			case 2:
-				DEBUG(TRACE_MISC, "q>>\n");
+				UDEBUG(TRACE_MISC, "q>>\n");
 				q >>= 1;
 				if (alu_out & 1)
 					q |= 0x80000000;
 				break;
 			case 3:
-				DEBUG(TRACE_MISC, "q<-alu\n");
+				UDEBUG(TRACE_MISC, "q<-alu\n");
 				q = alu_out;
 				break;
 			}
@@ -1117,8 +1443,8 @@ run(void)
 			// Output bus control.
 			switch (out_bus) {
 			case 0:
-				WARNING(TRACE_MISC, "out_bus == 0!\n");
-				out_bus = rotate_left(m_src_value, u & 037);
+				UWARNING(TRACE_MISC, "out_bus == 0!\n");
+				out_bus = rotate_left(m_src_value, d->pos);
 				break;
 			case 1:
 				out_bus = alu_out;
@@ -1135,30 +1461,30 @@ run(void)
 			}
 
 			write_dest(dest, out_bus);
-			DEBUG(TRACE_MISC, "alu_out 0x%08x, alu_carry %d, q 0x%08x\n", alu_out, alu_carry, q);
+			UDEBUG(TRACE_MISC, "alu_out 0x%08x, alu_carry %d, q 0x%08x\n", alu_out, alu_carry, q);
 			break;
 		case 1:		// JUMP
-			new_pc = (u >> 12) & 037777;
-			DEBUG(TRACE_MISC, "a=%o (%o), m=%o (%o)\n", a_src, a_src_value, m_src, m_src_value);
-			r_bit = (u >> 9) & 1;
-			p_bit = (u >> 8) & 1;
-			n_bit = (u >> 7) & 1;
-			invert_sense = (u >> 6) & 1;
+			new_pc = d->new_pc;
+			UDEBUG(TRACE_MISC, "a=%o (%o), m=%o (%o)\n", a_src, a_src_value, m_src, m_src_value);
+			r_bit = d->r_bit;
+			p_bit = d->p_bit;
+			n_bit = d->n_bit;
+			invert_sense = d->invert_sense;
 			take_jump = 0;
 
-			if (((u >> 10) & 3) == 1) {
-				DEBUG(TRACE_MISC, "halted\n");
+			if (d->misc == 1) {
+				UDEBUG(TRACE_MISC, "halted\n");
 				run_ucode_flag = 0;
 				break;
 			}
 
 		process_jump:
 			// Jump condition.
-			if (u & (1 << 5)) {
-				switch (u & 017) {
+			if (d->cond_test) {
+				switch (d->cond) {
 				case 0:
 					if (op_code != 2)
-						WARNING(TRACE_MISC, "jump-condition == 0! u_pc=%o\n", p0_pc);
+						UWARNING(TRACE_MISC, "jump-condition == 0! u_pc=%o\n", p0_pc);
 					break;
 				case 1:
 					take_jump = m_src_value < a_src_value;
@@ -1173,11 +1499,11 @@ run(void)
 					take_jump = page_fault_flag;
 					break;
 				case 5:
-					DEBUG(TRACE_MISC, "jump i|pf\n");
+					UDEBUG(TRACE_MISC, "jump i|pf\n");
 					take_jump = page_fault_flag | (interrupt_enable_flag ? interrupt_pending_flag : 0);
 					break;
 				case 6:
-					DEBUG(TRACE_MISC, "jump i|pf|sb\n");
+					UDEBUG(TRACE_MISC, "jump i|pf|sb\n");
 					take_jump = page_fault_flag | (interrupt_enable_flag ? interrupt_pending_flag : 0) | sequence_break_flag;
 					break;
 				case 7:
@@ -1185,15 +1511,15 @@ run(void)
 					break;
 				}
 			} else {
-				rot = u & 037;
-				DEBUG(TRACE_MISC, "jump-if-bit; rot %o, before %o ", rot, m_src_value);
+				rot = d->pos;
+				UDEBUG(TRACE_MISC, "jump-if-bit; rot %o, before %o ", rot, m_src_value);
 				m_src_value = rotate_left(m_src_value, rot);
-				DEBUG(TRACE_MISC, "after %o\n", m_src_value);
+				UDEBUG(TRACE_MISC, "after %o\n", m_src_value);
 				take_jump = m_src_value & 1;
 			}
 
-			if (((u >> 10) & 3) == 3) {
-				WARNING(TRACE_MISC, "jump w/misc-3!\n");
+			if (d->misc == 3) {
+				UWARNING(TRACE_MISC, "jump w/misc-3!\n");
 			}
 
 			if (invert_sense)
@@ -1208,8 +1534,19 @@ run(void)
 			// P & R & jump-inst -> write ucode.
 			if (p_bit && r_bit && op_code == 1) {
 				w = ((ucw_t) (a_src_value & 0177777) << 32) | (uint32_t) m_src_value;
-				DEBUG(TRACE_MISC, "u-code write; %Lo @ %o\n", w, new_pc);
+				UDEBUG(TRACE_MISC, "u-code write; %Lo @ %o\n", w, new_pc);
 				ucode[new_pc] = w;
+				ucode_decoded[new_pc].valid = false;
+
+				// An already fetched copy of the location
+				// must survive its redecode.
+				if (p1 == &ucode_decoded[new_pc]) {
+					struct udecode *h;
+
+					h = (d == &held_decoded[0]) ? &held_decoded[1] : &held_decoded[0];
+					*h = *p1;
+					p1 = h;
+				}
 			}
 			if (r_bit && take_jump) {
 				new_pc = pop_spc();
@@ -1227,16 +1564,16 @@ run(void)
 			}
 			break;
 		case 2:		// DISPATCH.
-			disp_const = (u >> 32) & 01777;
-			n_plus1 = (u >> 25) & 1;
-			enable_ish = (u >> 24) & 1;
-			disp_addr = (u >> 12) & 03777;
-			map = (u >> 8) & 3;
-			len = (u >> 5) & 07;
-			pos = u & 037;
+			disp_const = d->disp_const;
+			n_plus1 = d->n_plus1;
+			enable_ish = d->enable_ish;
+			disp_addr = d->disp_addr;
+			map = d->map;
+			len = d->len;
+			pos = d->pos;
 
 			// Misc. function 3.
-			if (((u >> 10) & 3) == 3) {
+			if (d->misc == 3) {
 				if (lc_byte_mode_flag) {
 					// Byte mode.
 					char ir4;
@@ -1244,35 +1581,35 @@ run(void)
 					char lc1;
 					char lc0;
 
-					ir4 = (u >> 4) & 1;
-					ir3 = (u >> 3) & 1;
+					ir4 = (d->pos >> 4) & 1;
+					ir3 = (d->pos >> 3) & 1;
 					lc1 = (lc >> 1) & 1;
 					lc0 = (lc >> 0) & 1;
-					pos = u & 007;
+					pos = d->pos & 007;
 					pos |= ((ir4 ^ (lc1 ^ lc0)) << 4) | ((ir3 ^ lc0) << 3);
-					DEBUG(TRACE_MISC, "byte-mode, pos %o\n", pos);
+					UDEBUG(TRACE_MISC, "byte-mode, pos %o\n", pos);
 				} else {
 					// 16 bit mode.
 					char ir4;
 					char lc1;
 
-					ir4 = (u >> 4) & 1;
+					ir4 = (d->pos >> 4) & 1;
 					lc1 = (lc >> 1) & 1;
 
-					pos = u & 017;
+					pos = d->pos & 017;
 
 					pos |= ((ir4 ^ lc1) ? 0 : 1) << 4;
-					DEBUG(TRACE_MISC, "16b-mode, pos %o\n", pos);
+					UDEBUG(TRACE_MISC, "16b-mode, pos %o\n", pos);
 				}
 			}
 			// Misc. function 2.
-			if (((u >> 10) & 3) == 2) {
-				DEBUG(TRACE_MISC, "dispatch_memory[%o] <- %o\n", disp_addr, a_src_value);
+			if (d->misc == 2) {
+				UDEBUG(TRACE_MISC, "dispatch_memory[%o] <- %o\n", disp_addr, a_src_value);
 				dispatch_memory[disp_addr] = a_src_value;
 				goto dispatch_done;
 			}
 
-			DEBUG(TRACE_MISC, "m-src %o, ", m_src_value);
+			UDEBUG(TRACE_MISC, "m-src %o, ", m_src_value);
 			// Rotate M-SOURCE.
 			m_src_value = rotate_left(m_src_value, pos);
 			// Generate mask.
@@ -1287,7 +1624,7 @@ run(void)
 			// Put LDB into DISPATCH-ADDR.
 			disp_addr |= m_src_value & mask;
 
-			DEBUG(TRACE_MISC, "rotated %o, mask %o, result %o\n", m_src_value, mask, m_src_value & mask);
+			UDEBUG(TRACE_MISC, "rotated %o, mask %o, result %o\n", m_src_value, mask, m_src_value & mask);
 
 			// Tweak DISPATCH-ADDR with L2 map bits.
 			if (map) {
@@ -1295,10 +1632,10 @@ run(void)
 				int bit18;
 				int bit19;
 
-				l2_map_bits = map_vtop(md, (int *) 0, (int *) 0);
+				l2_map_bits = tlb_lookup(md)->map;
 				bit19 = ((l2_map_bits >> 19) & 1) ? 1 : 0;
 				bit18 = ((l2_map_bits >> 18) & 1) ? 1 : 0;
-				DEBUG(TRACE_MISC, "md %o, l2_map_bits %o, b19 %o, b18 %o\n", md, l2_map_bits, bit19, bit18);
+				UDEBUG(TRACE_MISC, "md %o, l2_map_bits %o, b19 %o, b18 %o\n", md, l2_map_bits, bit19, bit18);
 				switch (map) {
 				case 1:
 					disp_addr |= bit18;
@@ -1313,7 +1650,7 @@ run(void)
 			}
 			disp_addr &= 03777;
 
-			DEBUG(TRACE_MISC, "dispatch[%o] -> %o ", disp_addr, dispatch_memory[disp_addr]);
+			UDEBUG(TRACE_MISC, "dispatch[%o] -> %o ", disp_addr, dispatch_memory[disp_addr]);
 
 			disp_addr = dispatch_memory[disp_addr];
 			dispatch_constant = disp_const;
@@ -1324,7 +1661,7 @@ run(void)
 			p_bit = (disp_addr >> 15) & 1;
 			r_bit = (disp_addr >> 16) & 1;
 
-			DEBUG(TRACE_MISC, "%s%s%s\n", n_bit ? "N " : "", p_bit ? "P " : "", r_bit ? "R " : "");
+			UDEBUG(TRACE_MISC, "%s%s%s\n", n_bit ? "N " : "", p_bit ? "P " : "", r_bit ? "R " : "");
 
 			if (n_plus1 && n_bit) {
 				u_pc--;
@@ -1332,7 +1669,7 @@ run(void)
 
 			invert_sense = 0;
 			take_jump = 1;
-			u = 1 << 5;
+			d = &dispatch_jump_decoded;
 
 			// Enable instruction sequence hardware.
 			if (enable_ish) {
@@ -1348,14 +1685,14 @@ run(void)
 		dispatch_done:
 			break;
 		case 3:		// BYTE.
-			dest = (u >> 14) & 07777;
-			mr_sr_bits = (u >> 12) & 3;
-			DEBUG(TRACE_MISC, "a=%o (%o), m=%o (%o), dest=%o\n", a_src, a_src_value, m_src, m_src_value, dest);
-			widthm1 = (u >> 5) & 037;
-			pos = u & 037;
+			dest = d->dest;
+			mr_sr_bits = d->mr_sr_bits;
+			UDEBUG(TRACE_MISC, "a=%o (%o), m=%o (%o), dest=%o\n", a_src, a_src_value, m_src, m_src_value, dest);
+			widthm1 = d->widthm1;
+			pos = d->pos;
 
 			// Misc. function 3.
-			if (((u >> 10) & 3) == 3) {
+			if (d->misc == 3) {
 				if (lc_byte_mode_flag) {
 					// Byte mode.
 					char ir4;
@@ -1363,25 +1700,25 @@ run(void)
 					char lc1;
 					char lc0;
 
-					ir4 = (u >> 4) & 1;
-					ir3 = (u >> 3) & 1;
+					ir4 = (d->pos >> 4) & 1;
+					ir3 = (d->pos >> 3) & 1;
 					lc1 = (lc >> 1) & 1;
 					lc0 = (lc >> 0) & 1;
 
-					pos = u & 007;
+					pos = d->pos & 007;
 					pos |= ((ir4 ^ (lc1 ^ lc0)) << 4) | ((ir3 ^ lc0) << 3);
-					DEBUG(TRACE_MISC, "byte-mode, pos %o\n", pos);
+					UDEBUG(TRACE_MISC, "byte-mode, pos %o\n", pos);
 				} else {
 					// 16-bit mode.
 					char ir4;
 					char lc1;
 
-					ir4 = (u >> 4) & 1;
+					ir4 = (d->pos >> 4) & 1;
 					lc1 = (lc >> 1) & 1;
 
-					pos = u & 017;
+					pos = d->pos & 017;
 					pos |= ((ir4 ^ lc1) ? 0 : 1) << 4;
-					DEBUG(TRACE_MISC, "16b-mode, pos %o\n", pos);
+					UDEBUG(TRACE_MISC, "16b-mode, pos %o\n", pos);
 				}
 			}
 
@@ -1400,32 +1737,32 @@ run(void)
 
 			mask = left_mask & right_mask;
 
-			DEBUG(TRACE_MISC, "widthm1 %o, pos %o, mr_sr_bits %o\n", widthm1, pos, mr_sr_bits);
-			DEBUG(TRACE_MISC, "left_mask_index %o, right_mask_index %o\n", left_mask_index, right_mask_index);
-			DEBUG(TRACE_MISC, "left_mask %o, right_mask %o, mask %o\n", left_mask, right_mask, mask);
+			UDEBUG(TRACE_MISC, "widthm1 %o, pos %o, mr_sr_bits %o\n", widthm1, pos, mr_sr_bits);
+			UDEBUG(TRACE_MISC, "left_mask_index %o, right_mask_index %o\n", left_mask_index, right_mask_index);
+			UDEBUG(TRACE_MISC, "left_mask %o, right_mask %o, mask %o\n", left_mask, right_mask, mask);
 
 			out_bus = 0;
 
 			switch (mr_sr_bits) {
 			case 0:
-				WARNING(TRACE_MISC, "mr_sr_bits == 0!\n");
+				UWARNING(TRACE_MISC, "mr_sr_bits == 0!\n");
 				break;
 			case 1:	// LDB.
-				DEBUG(TRACE_MISC, "ldb; m %o\n", m_src_value);
+				UDEBUG(TRACE_MISC, "ldb; m %o\n", m_src_value);
 				m_src_value = rotate_left(m_src_value, pos);
 				out_bus = (m_src_value & mask) | (a_src_value & ~mask);
-				DEBUG(TRACE_MISC, "ldb; m-rot %o, mask %o, result %o\n", m_src_value, mask, out_bus);
+				UDEBUG(TRACE_MISC, "ldb; m-rot %o, mask %o, result %o\n", m_src_value, mask, out_bus);
 				break;
 			case 2:	// Selective deposit.
 				out_bus = (m_src_value & mask) | (a_src_value & ~mask);
-				DEBUG(TRACE_MISC, "sel-dep; a %o, m %o, mask %o -> %o\n", a_src_value, m_src_value, mask, out_bus);
+				UDEBUG(TRACE_MISC, "sel-dep; a %o, m %o, mask %o -> %o\n", a_src_value, m_src_value, mask, out_bus);
 				break;
 			case 3:	// DPB.
-				DEBUG(TRACE_MISC, "dpb; m %o, pos %o\n", m_src_value, pos);
+				UDEBUG(TRACE_MISC, "dpb; m %o, pos %o\n", m_src_value, pos);
 				// Mask is already rotated.
 				m_src_value = rotate_left(m_src_value, pos);
 				out_bus = (m_src_value & mask) | (a_src_value & ~mask);
-				DEBUG(TRACE_MISC, "dpb; mask %o, result %o\n", mask, out_bus);
+				UDEBUG(TRACE_MISC, "dpb; mask %o, result %o\n", mask, out_bus);
 				break;
 			}
 
@@ -1434,7 +1771,7 @@ run(void)
 		}
 
 		if (popj) {
-			DEBUG(TRACE_MISC, "popj; ");
+			UDEBUG(TRACE_MISC, "popj; ");
 			u_pc = pop_spc();
 			if ((u_pc >> 14) & 1) {
 				advance_lc(&u_pc);
@@ -1443,3 +1780,85 @@ run(void)
 		}
 	}
 }
+
+void
+run(void)
+{
+	if (prof_flag) {
+		if (ucode_traced())
+			run_core(true, true);
+		else
+			run_core(false, true);
+	} else if (ucode_traced())
+		run_core(true, false);
+	else
+		run_core(false, false);
+}
+
+// Byte position for misc. function 3, selected by the LC.
+static int
+lc_byte_pos(int pos)
+{
+	char ir4;
+	char ir3;
+	char lc1;
+	char lc0;
+
+	ir4 = (pos >> 4) & 1;
+	ir3 = (pos >> 3) & 1;
+	lc1 = (lc >> 1) & 1;
+	lc0 = (lc >> 0) & 1;
+
+	if (lc_byte_mode_flag) {
+		// Byte mode.
+		pos &= 007;
+		pos |= ((ir4 ^ (lc1 ^ lc0)) << 4) | ((ir3 ^ lc0) << 3);
+		DEBUG(TRACE_MISC, "byte-mode, pos %o\n", pos);
+	} else {
+		// 16-bit mode.
+		pos &= 017;
+		pos |= ((ir4 ^ lc1) ? 0 : 1) << 4;
+		DEBUG(TRACE_MISC, "16b-mode, pos %o\n", pos);
+	}
+
+	return pos;
+}
+
+// The threaded core is compiled twice: with its trace sites, and
+// with them compiled out.
+#define THREADED_CORE run_threaded_traced
+#define THREADED_TRACED true
+#include "ucode_threaded.h"
+#undef THREADED_CORE
+#undef THREADED_TRACED
+
+#define THREADED_CORE run_threaded_fast
+#define THREADED_TRACED false
+#include "ucode_threaded.h"
+#undef THREADED_CORE
+#undef THREADED_TRACED
+
+// Same as run(), but dispatches through label tables (direct
+// threading) instead of nested switch statements; each M source,
+// ALU operation, Q control, output bus selector and destination
+// family has its own handler.
+void
+run_threaded(void)
+{
+	if (ucode_traced())
+		run_threaded_traced();
+	else
+		run_threaded_fast();
+}
+
+// Same as run_threaded(), but runs of straight-line RAM microcode
+// that are entered often are translated into blocks, which execute
+// without the per-cycle fetch and pipeline bookkeeping; on x86-64,
+// as host code where possible.
+void
+run_blocks(void)
+{
+	block_flag = true;
+	jit_init();
+	run_threaded();
+}
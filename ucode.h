@@ -2,6 +2,7 @@
 #define USIM_UCODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define NOP_MASK 03777777777767777LL
@@ -14,6 +15,15 @@ extern bool run_ucode_flag;
 extern int read_prom(char *promfn);
 
 extern void run(void);
+extern void run_threaded(void);
+extern void run_blocks(void);
+extern void ucode_init(void);
+extern size_t ucode_cycles(void);
+extern bool ucode_interrupts_enabled(void);
+extern int ucode_backtrace(int *pcs, int max);
+
+struct snapshot;
+extern void ucode_snapshot(struct snapshot *s);
 
 extern void write_a_mem(int loc, uint32_t v);
 extern uint32_t read_a_mem(int loc);
@@ -0,0 +1,610 @@
+// ucode_jit.h --- native code for microcode blocks
+//
+// Included by ucode.c.  On x86-64 hosts, the leading run of plain
+// ALU and BYTE instructions in a block is translated into host code,
+// which the block engine calls in place of stepping the threaded
+// handlers.  The rest of the block, if any, still runs on the
+// handlers.
+//
+// The generated code keeps all machine state in memory: each
+// instruction loads its sources from, and stores its results to, the
+// same variables the interpreter uses, addressed relative to RBX.
+// Functional destinations are written by calling write_dest().
+
+#if defined(__x86_64__)
+
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_ARENA_SIZE (8 * 1024 * 1024)
+#define JIT_INSN_MAX 160	// Longest code for one instruction.
+
+static uint8_t *jit_arena;
+static size_t jit_used;
+static bool jit_enabled;
+
+// Base of the RBX-relative addressing.
+#define JIT_BASE ((char *) a_memory)
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+// Condition codes for SETcc.
+#define CC_B 02
+#define CC_E 04
+#define CC_NE 05
+#define CC_L 014
+#define CC_LE 016
+
+// Group 1 and group 2 opcode extensions.
+#define OP_ADD 0
+#define OP_OR 1
+#define OP_AND 4
+#define OP_SUB 5
+#define OP_XOR 6
+#define OP_CMP 7
+
+#define SH_ROL 0
+#define SH_SHL 4
+#define SH_SHR 5
+
+static uint8_t *jit_p;
+
+static void
+emit8(int b)
+{
+	*jit_p++ = b;
+}
+
+static void
+emit32(uint32_t v)
+{
+	memcpy(jit_p, &v, 4);
+	jit_p += 4;
+}
+
+static void
+emit64(uint64_t v)
+{
+	memcpy(jit_p, &v, 8);
+	jit_p += 8;
+}
+
+// Displacement of the variable at P from JIT_BASE.
+static int32_t
+jit_off(void *p)
+{
+	return (int32_t) ((char *) p - JIT_BASE);
+}
+
+// MOV r32, [RBX + OFF].
+static void
+emit_load(int r, int32_t off)
+{
+	emit8(0x8b);
+	emit8(0x83 | r << 3);
+	emit32(off);
+}
+
+// MOV [RBX + OFF], r32.
+static void
+emit_store(int32_t off, int r)
+{
+	emit8(0x89);
+	emit8(0x83 | r << 3);
+	emit32(off);
+}
+
+static void
+emit_mov(int dst, int src)
+{
+	emit8(0x89);
+	emit8(0xc0 | src << 3 | dst);
+}
+
+static void
+emit_mov_imm(int dst, uint32_t imm)
+{
+	emit8(0xb8 + dst);
+	emit32(imm);
+}
+
+// OP dst, src; OP is one of the OP_xxx extensions.
+static void
+emit_op(int op, int dst, int src)
+{
+	emit8(op << 3 | 1);
+	emit8(0xc0 | src << 3 | dst);
+}
+
+static void
+emit_op_imm(int op, int dst, uint32_t imm)
+{
+	emit8(0x81);
+	emit8(0xc0 | op << 3 | dst);
+	emit32(imm);
+}
+
+static void
+emit_not(int r)
+{
+	emit8(0xf7);
+	emit8(0xd0 | r);
+}
+
+static void
+emit_shift(int sh, int r, int n)
+{
+	emit8(0xc1);
+	emit8(0xc0 | sh << 3 | r);
+	emit8(n);
+}
+
+static void
+emit_test(int dst, int src)
+{
+	emit8(0x85);
+	emit8(0xc0 | src << 3 | dst);
+}
+
+// SETcc r8, then MOVZX r32, r8; only for EAX to EBX.
+static void
+emit_setcc(int cc, int r)
+{
+	emit8(0x0f);
+	emit8(0x90 | cc);
+	emit8(0xc0 | r);
+	emit8(0x0f);
+	emit8(0xb6);
+	emit8(0xc0 | r << 3 | r);
+}
+
+// MOVSXD r64, r32.
+static void
+emit_movsxd(int r)
+{
+	emit8(0x48);
+	emit8(0x63);
+	emit8(0xc0 | r << 3 | r);
+}
+
+static void
+emit_add64(int dst, int src)
+{
+	emit8(0x48);
+	emit_op(OP_ADD, dst, src);
+}
+
+static void
+emit_add64_imm(int dst, int32_t imm)
+{
+	emit8(0x48);
+	emit_op_imm(OP_ADD, dst, imm);
+}
+
+static void
+emit_shr64(int r, int n)
+{
+	emit8(0x48);
+	emit_shift(SH_SHR, r, n);
+}
+
+static void
+emit_mov64_imm(int dst, uint64_t imm)
+{
+	emit8(0x48);
+	emit8(0xb8 + dst);
+	emit64(imm);
+}
+
+// M sources that are a plain load; the others bar translation.
+static bool
+jit_msrc_ok(int m_src)
+{
+	if (m_src < 040)
+		return true;
+
+	switch (m_src) {
+	case 040: case 042: case 043: case 046: case 047: case 050: case 052:
+		return true;
+	case 041: case 045: case 051: case 053: case 054: case 064: case 065:
+		return false;
+	}
+
+	return true;		// No such source, reads as 0.
+}
+
+// True if D can be translated.  JUMP and DISPATCH never reach here,
+// see block_insn_ok().
+static bool
+jit_insn_ok(struct udecode *d)
+{
+	if (d->nop)
+		return true;
+
+	if (!jit_msrc_ok(d->m_src))
+		return false;
+
+	if (d->dest_kind == DEST_A && (d->dest & 03777) >= 1024)
+		return false;
+
+	if (d->op_code == 0) {
+		switch (d->aluop) {
+		case 040: case 041: case 045: case 051:
+			return false;	// Depend on Q.
+		}
+		return d->out_bus != 0;
+	}
+
+	return d->op_code == 3 && d->misc != 3 && d->mr_sr_bits != 0;
+}
+
+// Load the M source into EAX.
+static void
+jit_msrc(int m_src)
+{
+	if (m_src < 040) {
+		emit_load(EAX, jit_off(&m_memory[m_src]));
+		return;
+	}
+
+	switch (m_src) {
+	case 040: emit_load(EAX, jit_off(&dispatch_constant)); break;
+	case 042: emit_load(EAX, jit_off(&pdl_ptr)); emit_op_imm(OP_AND, EAX, 01777); break;
+	case 043: emit_load(EAX, jit_off(&pdl_index)); emit_op_imm(OP_AND, EAX, 01777); break;
+	case 046: emit_load(EAX, jit_off(&opc)); break;
+	case 047: emit_load(EAX, jit_off(&q)); break;
+	case 050: emit_load(EAX, jit_off(&vma)); break;
+	case 052: emit_load(EAX, jit_off(&md)); break;
+	default: emit_op(OP_XOR, EAX, EAX); break;
+	}
+}
+
+// Terms of the arithmetic ALU operations, computed into R from M in
+// EAX and A in ECX.
+enum { T_NONE, T_M, T_AND, T_ANDCA, T_IOR, T_ORCA };
+
+static void
+jit_term(int r, int t)
+{
+	switch (t) {
+	case T_M:
+		emit_mov(r, EAX);
+		break;
+	case T_AND:
+		emit_mov(r, EAX);
+		emit_op(OP_AND, r, ECX);
+		break;
+	case T_ANDCA:
+		emit_mov(r, ECX);
+		emit_not(r);
+		emit_op(OP_AND, r, EAX);
+		break;
+	case T_IOR:
+		emit_mov(r, EAX);
+		emit_op(OP_OR, r, ECX);
+		break;
+	case T_ORCA:
+		emit_mov(r, ECX);
+		emit_not(r);
+		emit_op(OP_OR, r, EAX);
+		break;
+	}
+}
+
+// ALU output and carry are the low 32 bits of the sign-extended sum
+// T1 + T2 + K, and whether its high 32 bits are non-zero.
+static void
+jit_alu_lv(int t1, int t2, int k)
+{
+	jit_term(ESI, t1);
+	emit_movsxd(ESI);
+	if (t2 != T_NONE) {
+		jit_term(EDI, t2);
+		emit_movsxd(EDI);
+		emit_add64(ESI, EDI);
+	}
+	if (k)
+		emit_add64_imm(ESI, k);
+	emit_mov(EDX, ESI);
+	emit_shr64(ESI, 32);
+	emit_test(ESI, ESI);
+	emit_setcc(CC_NE, EAX);
+}
+
+// Compute the ALU output into EDX and the carry into EAX, from M in
+// EAX and A in ECX; see the alu_xxx handlers.
+static void
+jit_alu(int aluop, int carry_in)
+{
+	int k;
+
+	k = carry_in ? 0 : -1;
+
+	switch (aluop) {
+	case 000: emit_mov_imm(EDX, 0); break;
+	case 001: emit_mov(EDX, EAX); emit_op(OP_AND, EDX, ECX); break;
+	case 002: emit_mov(EDX, ECX); emit_not(EDX); emit_op(OP_AND, EDX, EAX); break;
+	case 003: emit_mov(EDX, EAX); break;
+	case 004: emit_mov(EDX, EAX); emit_not(EDX); emit_op(OP_AND, EDX, ECX); break;
+	case 005: emit_mov(EDX, ECX); break;
+	case 006: emit_mov(EDX, EAX); emit_op(OP_XOR, EDX, ECX); break;
+	case 007: emit_mov(EDX, EAX); emit_op(OP_OR, EDX, ECX); break;
+	case 010: emit_mov(EDX, EAX); emit_op(OP_OR, EDX, ECX); emit_not(EDX); break;
+	case 011: emit_op(OP_CMP, EAX, ECX); emit_setcc(CC_E, EDX); break;
+	case 012: emit_mov(EDX, ECX); emit_not(EDX); break;
+	case 013: jit_term(EDX, T_ORCA); break;
+	case 014: emit_mov(EDX, EAX); emit_not(EDX); break;
+	case 015: emit_mov(EDX, EAX); emit_not(EDX); emit_op(OP_OR, EDX, ECX); break;
+	case 016: emit_mov(EDX, EAX); emit_op(OP_AND, EDX, ECX); emit_not(EDX); break;
+	case 017: emit_mov_imm(EDX, ~0u); break;
+	case 020: emit_mov_imm(EDX, carry_in ? 0 : ~0u); break;
+
+	case 021: jit_alu_lv(T_AND, T_NONE, k); return;
+	case 022: jit_alu_lv(T_ANDCA, T_NONE, k); return;
+	case 023: jit_alu_lv(T_M, T_NONE, k); return;
+	case 024: jit_alu_lv(T_ORCA, T_NONE, carry_in); return;
+	case 025: jit_alu_lv(T_ORCA, T_AND, carry_in); return;
+	case 027: jit_alu_lv(T_ORCA, T_M, carry_in); return;
+	case 030: jit_alu_lv(T_IOR, T_NONE, carry_in); return;
+	case 032: jit_alu_lv(T_IOR, T_ANDCA, carry_in); return;
+	case 033: jit_alu_lv(T_IOR, T_M, carry_in); return;
+	case 035: jit_alu_lv(T_M, T_AND, carry_in); return;
+	case 036: jit_alu_lv(T_M, T_ORCA, carry_in); return;
+
+	case 026:
+		// sub32(): the carry is OUT < M, unsigned.
+		emit_mov(EDX, EAX);
+		emit_op(OP_SUB, EDX, ECX);
+		if (!carry_in)
+			emit_op_imm(OP_SUB, EDX, 1);
+		emit_op(OP_CMP, EDX, EAX);
+		emit_setcc(CC_B, EAX);
+		return;
+	case 031:
+	case 037:
+		// add32(): the carry is A < ~M (A <= ~M without carry
+		// in), signed.
+		if (aluop == 037)
+			emit_mov(ECX, EAX);
+		emit_mov(EDX, EAX);
+		emit_op(OP_ADD, EDX, ECX);
+		if (carry_in)
+			emit_op_imm(OP_ADD, EDX, 1);
+		emit_mov(ESI, EAX);
+		emit_not(ESI);
+		emit_op(OP_CMP, ECX, ESI);
+		emit_setcc(carry_in ? CC_L : CC_LE, EAX);
+		return;
+	case 034:
+		emit_mov(EDX, EAX);
+		if (carry_in) {
+			emit_op_imm(OP_ADD, EDX, 1);
+			emit_op_imm(OP_CMP, EAX, ~0u);
+			emit_setcc(CC_E, EAX);
+		} else
+			emit_op(OP_XOR, EAX, EAX);
+		return;
+
+	default:
+		// Unused operations leave the ALU output alone.
+		emit_load(EDX, jit_off(&alu_out));
+		break;
+	}
+
+	emit_op(OP_XOR, EAX, EAX);
+}
+
+// Q control and output bus selector; the result is left in ESI.
+static void
+jit_q_obus(int q_control, int out_bus)
+{
+	if (out_bus == 3)
+		emit_load(EDI, jit_off(&q));
+
+	switch (q_control) {
+	case 1:
+		emit_load(ESI, jit_off(&q));
+		emit_shift(SH_SHL, ESI, 1);
+		emit_mov(ECX, EDX);
+		emit_shift(SH_SHR, ECX, 31);
+		emit_op_imm(OP_XOR, ECX, 1);
+		emit_op(OP_OR, ESI, ECX);
+		emit_store(jit_off(&q), ESI);
+		break;
+	case 2:
+		emit_load(ESI, jit_off(&q));
+		emit_shift(SH_SHR, ESI, 1);
+		emit_mov(ECX, EDX);
+		emit_shift(SH_SHL, ECX, 31);
+		emit_op(OP_OR, ESI, ECX);
+		emit_store(jit_off(&q), ESI);
+		break;
+	case 3:
+		emit_store(jit_off(&q), EDX);
+		break;
+	}
+
+	emit_mov(ESI, EDX);
+	switch (out_bus) {
+	case 2:
+		emit_shift(SH_SHR, ESI, 1);
+		emit_mov(ECX, EAX);
+		emit_shift(SH_SHL, ECX, 31);
+		emit_op(OP_OR, ESI, ECX);
+		break;
+	case 3:
+		emit_shift(SH_SHL, ESI, 1);
+		emit_shift(SH_SHR, EDI, 31);
+		emit_op(OP_OR, ESI, EDI);
+		break;
+	}
+}
+
+// BYTE: the result is left in ESI.
+static void
+jit_byte(struct udecode *d)
+{
+	uint32_t mask;
+	int left;
+	int right;
+
+	right = (d->mr_sr_bits & 2) ? d->pos : 0;
+	left = (right + d->widthm1) & 037;
+	mask = (~0u >> (31 - left)) & (~0u << right);
+
+	if (d->mr_sr_bits != 2 && d->pos)
+		emit_shift(SH_ROL, EAX, d->pos);
+	emit_op_imm(OP_AND, EAX, mask);
+	emit_op_imm(OP_AND, ECX, ~mask);
+	emit_op(OP_OR, EAX, ECX);
+	emit_mov(ESI, EAX);
+}
+
+// Write ESI to the destination.
+static void
+jit_dest(struct udecode *d)
+{
+	switch (d->dest_kind) {
+	case DEST_M:
+		emit_store(jit_off(&m_memory[d->dest & 037]), ESI);
+		emit_store(jit_off(&a_memory[d->dest & 037]), ESI);
+		break;
+	case DEST_A:
+		emit_store(jit_off(&a_memory[d->dest & 03777]), ESI);
+		break;
+	case DEST_FUNC:
+		emit_mov_imm(EDI, d->dest);
+		emit_mov64_imm(EAX, (uint64_t) (uintptr_t) write_dest);
+		emit8(0xff);	// CALL RAX.
+		emit8(0xd0);
+		break;
+	}
+}
+
+static void
+jit_insn(struct udecode *d)
+{
+	if (d->nop)
+		return;
+
+	emit_load(ECX, jit_off(&a_memory[d->a_src]));
+	jit_msrc(d->m_src);
+
+	if (d->op_code == 0) {
+		jit_alu(d->aluop, d->carry_in);
+		emit_store(jit_off(&alu_carry), EAX);
+		emit_store(jit_off(&alu_out), EDX);
+		jit_q_obus(d->q_control, d->out_bus);
+	} else
+		jit_byte(d);
+
+	jit_dest(d);
+}
+
+// Drop all native code; the blocks are translated again once they
+// are hot again.
+static void
+jit_flush(void)
+{
+	for (int i = 0; i < 16 * 1024; i++) {
+		ucode_blocks[i].valid = false;
+		ucode_blocks[i].hits = 0;
+	}
+	jit_used = 0;
+}
+
+// Translate the leading instructions of block B at PC.
+static void
+jit_translate(struct ublock *b, int pc)
+{
+	uint8_t *start;
+	int n;
+
+	if (!jit_enabled)
+		return;
+
+	for (n = 0; n < b->len; n++) {
+		if (!jit_insn_ok(&ucode_decoded[pc + n]))
+			break;
+	}
+	if (n < 2)
+		return;
+
+	if (jit_used + (n + 1) * JIT_INSN_MAX > JIT_ARENA_SIZE) {
+		DEBUG(TRACE_MISC, "jit: arena full, flushing\n");
+		jit_flush();
+		b->valid = true;
+	}
+
+	if (mprotect(jit_arena, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) == -1) {
+		WARNING(TRACE_MISC, "jit: mprotect failed, native code disabled\n");
+		jit_enabled = false;
+		return;
+	}
+
+	start = jit_p = jit_arena + jit_used;
+	emit8(0x53);		// PUSH RBX.
+	emit_mov64_imm(EBX, (uint64_t) (uintptr_t) JIT_BASE);
+	for (int i = 0; i < n; i++)
+		jit_insn(&ucode_decoded[pc + i]);
+	emit8(0x5b);		// POP RBX.
+	emit8(0xc3);		// RET.
+	jit_used = (jit_p - jit_arena + 15) & ~15;
+
+	if (mprotect(jit_arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) == -1) {
+		WARNING(TRACE_MISC, "jit: mprotect failed, native code disabled\n");
+		jit_enabled = false;
+		return;
+	}
+
+	b->native = (void (*)(void)) start;
+	b->native_len = n;
+	DEBUG(TRACE_MISC, "jit: block %o, %d of %d native, %d bytes\n", pc, n, b->len, (int) (jit_p - start));
+}
+
+// Set up the code arena.  Native code is only used if every variable
+// it touches can be addressed from JIT_BASE.
+static void
+jit_init(void)
+{
+	void *vars[] = {
+		a_memory, m_memory, &q, &vma, &md, &opc, &dispatch_constant,
+		&pdl_ptr, &pdl_index, &alu_out, &alu_carry,
+	};
+
+	for (size_t i = 0; i < sizeof vars / sizeof vars[0]; i++) {
+		ptrdiff_t off;
+
+		off = (char *) vars[i] - JIT_BASE;
+		if (off < INT32_MIN / 2 || off > INT32_MAX / 2) {
+			NOTICE(TRACE_MISC, "jit: state out of reach, native code disabled\n");
+			return;
+		}
+	}
+
+	jit_arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit_arena == MAP_FAILED) {
+		NOTICE(TRACE_MISC, "jit: no executable memory, native code disabled\n");
+		jit_arena = NULL;
+		return;
+	}
+
+	jit_enabled = true;
+}
+
+#else
+
+static void
+jit_translate(struct ublock *b, int pc)
+{
+	(void) b;
+	(void) pc;
+}
+
+static void
+jit_init(void)
+{
+}
+
+#endif
@@ -0,0 +1,809 @@
+// ucode_threaded.h --- threaded microcode interpreter core
+//
+// Included twice by ucode.c, with THREADED_CORE naming the function
+// and THREADED_TRACED saying whether the trace sites are compiled in.
+
+// Same as run(), but dispatches through label tables (direct
+// threading) instead of nested switch statements; each M source,
+// ALU operation, Q control, output bus selector and destination
+// family has its own handler.
+static void
+THREADED_CORE(void)
+{
+	const bool traced = THREADED_TRACED;
+	void *msrc_labels[64];
+	void *alu_labels[64];
+	void *op_labels[4] = {
+		&&op_alu, &&op_jump, &&op_dispatch, &&op_byte,
+	};
+	void *q_labels[4] = {
+		&&q_none, &&q_left, &&q_right, &&q_load,
+	};
+	void *obus_labels[4] = {
+		&&obus_rotate, &&obus_alu, &&obus_right, &&obus_left,
+	};
+	void *dest_labels[3] = {
+		[DEST_M] = &&dest_m,
+		[DEST_A] = &&dest_a,
+		[DEST_FUNC] = &&dest_func,
+	};
+	struct udecode *p0;
+	struct udecode *p1;
+	struct udecode *d;
+	int p0_pc;
+	int p1_pc;
+	char no_exec_next;
+	int m_src_value;
+	int block_pc;
+	int block_end;
+	int carry_in;
+	uint32_t old_q;
+	uint32_t out_bus;
+
+	for (int i = 0; i < 64; i++) {
+		msrc_labels[i] = i < 040 ? &&msrc_m_mem : &&msrc_none;
+		alu_labels[i] = &&alu_none;
+	}
+
+	msrc_labels[040] = &&msrc_dispatch_constant;
+	msrc_labels[041] = &&msrc_spc_ptr;
+	msrc_labels[042] = &&msrc_pdl_ptr;
+	msrc_labels[043] = &&msrc_pdl_index;
+	msrc_labels[045] = &&msrc_pdl_by_index;
+	msrc_labels[046] = &&msrc_opc;
+	msrc_labels[047] = &&msrc_q;
+	msrc_labels[050] = &&msrc_vma;
+	msrc_labels[051] = &&msrc_map;
+	msrc_labels[052] = &&msrc_md;
+	msrc_labels[053] = &&msrc_lc;
+	msrc_labels[054] = &&msrc_spc_pop;
+	msrc_labels[064] = &&msrc_pdl_pop;
+	msrc_labels[065] = &&msrc_pdl_by_ptr;
+
+	alu_labels[000] = &&alu_setz;
+	alu_labels[001] = &&alu_and;
+	alu_labels[002] = &&alu_andca;
+	alu_labels[003] = &&alu_setm;
+	alu_labels[004] = &&alu_andcm;
+	alu_labels[005] = &&alu_seta;
+	alu_labels[006] = &&alu_xor;
+	alu_labels[007] = &&alu_ior;
+	alu_labels[010] = &&alu_andcb;
+	alu_labels[011] = &&alu_eqv;
+	alu_labels[012] = &&alu_setca;
+	alu_labels[013] = &&alu_orca;
+	alu_labels[014] = &&alu_setcm;
+	alu_labels[015] = &&alu_orcm;
+	alu_labels[016] = &&alu_orcb;
+	alu_labels[017] = &&alu_seto;
+	alu_labels[020] = &&alu_20;
+	alu_labels[021] = &&alu_21;
+	alu_labels[022] = &&alu_22;
+	alu_labels[023] = &&alu_23;
+	alu_labels[024] = &&alu_24;
+	alu_labels[025] = &&alu_25;
+	alu_labels[026] = &&alu_sub;
+	alu_labels[027] = &&alu_27;
+	alu_labels[030] = &&alu_30;
+	alu_labels[031] = &&alu_add;
+	alu_labels[032] = &&alu_32;
+	alu_labels[033] = &&alu_33;
+	alu_labels[034] = &&alu_m_plus_1;
+	alu_labels[035] = &&alu_35;
+	alu_labels[036] = &&alu_36;
+	alu_labels[037] = &&alu_m_plus_m;
+	alu_labels[040] = &&alu_mul_step;
+	alu_labels[041] = &&alu_div_step;
+	alu_labels[045] = &&alu_rem_corr;
+	alu_labels[051] = &&alu_div_first_step;
+
+	carry_in = 0;
+	old_q = 0;
+	out_bus = 0;
+
+	u_pc = 0;
+
+	p1 = &nop_decoded;
+	p0_pc = 0;
+	p1_pc = 0;
+	no_exec_next = 0;
+	m_src_value = 0;
+	block_pc = 0;
+	block_end = 0;
+	d = &nop_decoded;
+
+	if (!nop_decoded.valid) {
+		ucode_decode(0, &nop_decoded);
+		ucode_decode(1 << 5, &dispatch_jump_decoded);
+	}
+
+	if (!pipeline_resume(&p1, &p1_pc, &no_exec_next))
+		write_phy_mem(0, 0);
+
+	while (run_ucode_flag) {
+		char take_jump;
+		int new_pc;
+		int r_bit;
+		int p_bit;
+		int n_bit;
+		int a_src_value;
+		int pos;
+		int disp_addr;
+		uint32_t mask;
+		int64_t lv;
+		char popj;
+
+		m_src_value = 0;
+
+		if (cycles == 0) {
+			p0 = p1 = &nop_decoded;
+			p1_pc = 0;
+			no_exec_next = 0;
+		}
+
+	next:
+		// Enter a block if nothing is pending in the pipeline.
+		if (block_flag && run_ucode_flag && !prom_enabled_flag && !no_exec_next && new_md_delay == 0 &&
+		    !oa_reg_lo_set && !oa_reg_hi_set && u_pc == p1_pc + 1 && p1 == &ucode_decoded[p1_pc]) {
+			struct ublock *b;
+
+			b = &ucode_blocks[p1_pc];
+			if (!b->valid && ++b->hits >= BLOCK_HOT)
+				block_translate(p1_pc);
+
+			if (b->valid && b->len) {
+				block_pc = p1_pc;
+				block_end = p1_pc + b->len;
+
+				// Host code, unless an event falls due
+				// inside it.
+				if (!traced && b->native && cycles + b->native_len <= sched_next) {
+					b->native();
+					cycles += b->native_len;
+					block_pc += b->native_len;
+					d = &ucode_decoded[block_pc - 1];
+				}
+				goto block_step;
+			}
+		}
+
+		if (cycles >= sched_next)
+			ucode_sched_run(p1, p1_pc, u_pc, no_exec_next);
+
+		// Enforce max. cycles.
+		cycles++;
+		if (cycles == 0)
+			// Handle overflow.
+			cycles = 1;
+
+		// CPU pipeline.
+		p0 = p1;
+		p0_pc = p1_pc;
+		p1 = fetch_decoded(u_pc);
+		p1_pc = u_pc;
+		u_pc++;
+
+		if (new_md_delay) {
+			new_md_delay--;
+			if (new_md_delay == 0)
+				md = new_md;
+		}
+
+		// Stall pipe for one cycle.
+		if (no_exec_next) {
+			UDEBUG(TRACE_MISC, "no_exec_next; u_pc %o\n", u_pc);
+			no_exec_next = 0;
+
+			p0 = p1;
+			p0_pc = p1_pc;
+
+			p1 = fetch_decoded(u_pc);
+			p1_pc = u_pc;
+			u_pc++;
+		}
+
+		d = p0;
+	execute:
+
+		// Next instruction modify.
+		if (oa_reg_lo_set || oa_reg_hi_set) {
+			ucw_t u;
+
+			u = d->u;
+			if (oa_reg_lo_set) {
+				UDEBUG(TRACE_MISC, "merging oa lo %o\n", oa_reg_lo);
+				oa_reg_lo_set = 0;
+				u |= oa_reg_lo;
+			}
+
+			if (oa_reg_hi_set) {
+				UDEBUG(TRACE_MISC, "merging oa hi %o\n", oa_reg_hi);
+				oa_reg_hi_set = 0;
+				u |= (ucw_t) oa_reg_hi << 26;
+			}
+
+			ucode_decode(u, &oa_decoded);
+			d = &oa_decoded;
+		}
+
+		// NOP short cut.
+		if (d->nop)
+			goto next;
+
+		popj = d->popj;
+		a_src_value = read_a_mem(d->a_src);
+
+		goto *msrc_labels[d->m_src];
+
+		// M source.
+	msrc_m_mem:
+		m_src_value = read_m_mem(d->m_src);
+		goto *op_labels[d->op_code];
+	msrc_dispatch_constant:
+		m_src_value = dispatch_constant;
+		goto *op_labels[d->op_code];
+	msrc_spc_ptr:
+		m_src_value = (spc_stack_ptr << 24) | (spc_stack[spc_stack_ptr] & 01777777);
+		goto *op_labels[d->op_code];
+	msrc_pdl_ptr:
+		m_src_value = pdl_ptr & 01777;
+		goto *op_labels[d->op_code];
+	msrc_pdl_index:
+		m_src_value = pdl_index & 01777;
+		goto *op_labels[d->op_code];
+	msrc_pdl_by_index:
+		UDEBUG(TRACE_MISC, "reading pdl[%o] -> %o\n", pdl_index, read_pdl_mem(USE_PDL_INDEX));
+		m_src_value = read_pdl_mem(USE_PDL_INDEX);
+		goto *op_labels[d->op_code];
+	msrc_opc:
+		m_src_value = opc;
+		goto *op_labels[d->op_code];
+	msrc_q:
+		m_src_value = q;
+		goto *op_labels[d->op_code];
+	msrc_vma:
+		m_src_value = vma;
+		goto *op_labels[d->op_code];
+	msrc_map:
+		{
+			uint32_t l2_data;
+			uint32_t l1_data;
+
+			l2_data = tlb_lookup(md)->map;
+			l1_data = tlb_lookup(md)->l1;
+			m_src_value = ((uint32_t) write_fault_bit << 31) | ((uint32_t) access_fault_bit << 30) | ((l1_data & 037) << 24) | (l2_data & 077777777);
+		}
+		goto *op_labels[d->op_code];
+	msrc_md:
+		m_src_value = md;
+		goto *op_labels[d->op_code];
+	msrc_lc:
+		if (lc_byte_mode_flag)
+			m_src_value = lc;
+		else
+			m_src_value = lc & ~1;
+		goto *op_labels[d->op_code];
+	msrc_spc_pop:
+		m_src_value = (spc_stack_ptr << 24) | (spc_stack[spc_stack_ptr] & 01777777);
+		UDEBUG(TRACE_MISC, "reading spc[%o] + ptr -> %o\n", spc_stack_ptr, m_src_value);
+		spc_stack_ptr = (spc_stack_ptr - 1) & 037;
+		if (spc_depth > 0)
+			spc_depth--;
+		goto *op_labels[d->op_code];
+	msrc_pdl_pop:
+		UDEBUG(TRACE_MISC, "reading pdl[%o] -> %o, pop\n", pdl_ptr, read_pdl_mem(USE_PDL_PTR));
+		m_src_value = read_pdl_mem(USE_PDL_PTR);
+		pdl_ptr = (pdl_ptr - 1) & 01777;
+		goto *op_labels[d->op_code];
+	msrc_pdl_by_ptr:
+		UDEBUG(TRACE_MISC, "reading pdl[%o] -> %o\n", pdl_ptr, read_pdl_mem(USE_PDL_PTR));
+		m_src_value = read_pdl_mem(USE_PDL_PTR);
+		goto *op_labels[d->op_code];
+	msrc_none:
+		goto *op_labels[d->op_code];
+
+		// ALU.
+	op_alu:
+		carry_in = d->carry_in;
+		alu_carry = 0;
+		goto *alu_labels[d->aluop];
+
+		// Arithmetic.
+	alu_20:
+		alu_out = carry_in ? 0 : -1;
+		alu_carry = 0;
+		goto alu_done;
+	alu_21:
+		lv = (int64_t) (m_src_value & a_src_value) - (carry_in ? 0 : 1);
+		goto alu_done_lv;
+	alu_22:
+		lv = (int64_t) (m_src_value & ~a_src_value) - (carry_in ? 0 : 1);
+		goto alu_done_lv;
+	alu_23:
+		lv = (int64_t) m_src_value - (carry_in ? 0 : 1);
+		goto alu_done_lv;
+	alu_24:
+		lv = (int64_t) (m_src_value | ~a_src_value) + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_25:
+		lv = (int64_t) (m_src_value | ~a_src_value) + (m_src_value & a_src_value) + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_sub:
+		sub32(m_src_value, a_src_value, carry_in, alu_out, alu_carry);
+		goto alu_done;
+	alu_27:
+		lv = (int64_t) (m_src_value | ~a_src_value) + m_src_value + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_30:
+		lv = (int64_t) (m_src_value | a_src_value) + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_add:
+		add32(m_src_value, a_src_value, carry_in, alu_out, alu_carry);
+		goto alu_done;
+	alu_32:
+		lv = (int64_t) (m_src_value | a_src_value) + (m_src_value & ~a_src_value) + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_33:
+		lv = (int64_t) (m_src_value | a_src_value) + m_src_value + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_m_plus_1:
+		alu_out = m_src_value + (carry_in ? 1 : 0);
+		alu_carry = 0;
+		if (m_src_value == (int) 0xffffffff && carry_in)
+			alu_carry = 1;
+		goto alu_done;
+	alu_35:
+		lv = (int64_t) m_src_value + (m_src_value & a_src_value) + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_36:
+		lv = (int64_t) m_src_value + (m_src_value | ~a_src_value) + (carry_in ? 1 : 0);
+		goto alu_done_lv;
+	alu_m_plus_m:
+		add32(m_src_value, m_src_value, carry_in, alu_out, alu_carry);
+		goto alu_done;
+
+		// Boolean.
+	alu_setz:
+		alu_out = 0;
+		goto alu_done;
+	alu_and:
+		alu_out = m_src_value & a_src_value;
+		goto alu_done;
+	alu_andca:
+		alu_out = m_src_value & ~a_src_value;
+		goto alu_done;
+	alu_setm:
+		alu_out = m_src_value;
+		goto alu_done;
+	alu_andcm:
+		alu_out = ~m_src_value & a_src_value;
+		goto alu_done;
+	alu_seta:
+		alu_out = a_src_value;
+		goto alu_done;
+	alu_xor:
+		alu_out = m_src_value ^ a_src_value;
+		goto alu_done;
+	alu_ior:
+		alu_out = m_src_value | a_src_value;
+		goto alu_done;
+	alu_andcb:
+		alu_out = ~a_src_value & ~m_src_value;
+		goto alu_done;
+	alu_eqv:
+		alu_out = a_src_value == m_src_value;
+		goto alu_done;
+	alu_setca:
+		alu_out = ~a_src_value;
+		goto alu_done;
+	alu_orca:
+		alu_out = m_src_value | ~a_src_value;
+		goto alu_done;
+	alu_setcm:
+		alu_out = ~m_src_value;
+		goto alu_done;
+	alu_orcm:
+		alu_out = ~m_src_value | a_src_value;
+		goto alu_done;
+	alu_orcb:
+		alu_out = ~m_src_value | ~a_src_value;
+		goto alu_done;
+	alu_seto:
+		alu_out = ~0;
+		goto alu_done;
+
+		// Conditional ALU operation.
+	alu_mul_step:
+		if (q & 1) {
+			add32(a_src_value, m_src_value, carry_in, alu_out, alu_carry);
+		} else {
+			alu_out = m_src_value;
+			alu_carry = alu_out & 0x80000000 ? 1 : 0;
+		}
+		goto alu_done;
+	alu_div_step:
+		UDEBUG(TRACE_MISC, "do_sub %d\n", q & 1);
+		if (q & 1) {
+			sub32(m_src_value, a_src_value, !carry_in, alu_out, alu_carry);
+		} else {
+			add32(m_src_value, a_src_value, carry_in, alu_out, alu_carry);
+		}
+		goto alu_done;
+	alu_rem_corr:
+		UDEBUG(TRACE_MISC, "do_sub %d\n", q & 1);
+		if (q & 1) {
+			alu_carry = 0;
+		} else {
+			add32(alu_out, (uint32_t) a_src_value, carry_in, alu_out, alu_carry);
+		}
+		goto alu_done;
+	alu_div_first_step:
+		UDEBUG(TRACE_MISC, "divide-first-step\n");
+		UDEBUG(TRACE_MISC, "divide: %o / %o \n", q, a_src_value);
+		sub32(m_src_value, a_src_value, !carry_in, alu_out, alu_carry);
+		UDEBUG(TRACE_MISC, "alu_out %08x %o %d\n", alu_out, alu_out, alu_out);
+		goto alu_done;
+	alu_none:
+		goto alu_done;
+
+	alu_done_lv:
+		alu_out = (uint32_t) lv;
+		alu_carry = (lv >> 32) ? 1 : 0;
+	alu_done:
+		old_q = q;
+		goto *q_labels[d->q_control];
+
+		// Q control.
+	q_left:
+		UDEBUG(TRACE_MISC, "q<<\n");
+		q <<= 1;
+		// Inverse of ALU sign.
+		if ((alu_out & 0x80000000) == 0)
+			q |= 1;
+		goto *obus_labels[d->out_bus];
+	q_right:
+		UDEBUG(TRACE_MISC, "q>>\n");
+		q >>= 1;
+		if (alu_out & 1)
+			q |= 0x80000000;
+		goto *obus_labels[d->out_bus];
+	q_load:
+		UDEBUG(TRACE_MISC, "q<-alu\n");
+		q = alu_out;
+		goto *obus_labels[d->out_bus];
+	q_none:
+		goto *obus_labels[d->out_bus];
+
+		// Output bus control.
+	obus_rotate:
+		UWARNING(TRACE_MISC, "out_bus == 0!\n");
+		out_bus = rotate_left(m_src_value, d->pos);
+		goto alu_dest;
+	obus_alu:
+		out_bus = alu_out;
+		goto alu_dest;
+	obus_right:
+		// "ALU output shifted right one, with the correct
+		// sign shifted in, regardless of overflow."
+		out_bus = (alu_out >> 1) | (alu_carry ? 0x80000000 : 0);
+		goto alu_dest;
+	obus_left:
+		out_bus = (alu_out << 1) | ((old_q & 0x80000000) ? 1 : 0);
+		goto alu_dest;
+
+	alu_dest:
+		UDEBUG(TRACE_MISC, "alu_out 0x%08x, alu_carry %d, q 0x%08x\n", alu_out, alu_carry, q);
+		goto *dest_labels[d->dest_kind];
+
+		// Destination.
+	dest_m:
+		write_m_mem(d->dest & 037, out_bus);
+		goto done;
+	dest_a:
+		write_a_mem(d->dest & 03777, out_bus);
+		goto done;
+	dest_func:
+		write_dest(d->dest, out_bus);
+		goto done;
+
+		// JUMP.
+	op_jump:
+		new_pc = d->new_pc;
+		UDEBUG(TRACE_MISC, "a=%o (%o), m=%o (%o)\n", d->a_src, a_src_value, d->m_src, m_src_value);
+		r_bit = d->r_bit;
+		p_bit = d->p_bit;
+		n_bit = d->n_bit;
+		take_jump = 0;
+
+		if (d->misc == 1) {
+			UDEBUG(TRACE_MISC, "halted\n");
+			run_ucode_flag = 0;
+			goto done;
+		}
+
+	process_jump:
+		// Jump condition.
+		if (d->cond_test) {
+			switch (d->cond) {
+			case 0:
+				// Taken dispatches come here with D set to
+				// DISPATCH_JUMP_DECODED.
+				if (d != &dispatch_jump_decoded)
+					UWARNING(TRACE_MISC, "jump-condition == 0! u_pc=%o\n", p0_pc);
+				break;
+			case 1:
+				take_jump = m_src_value < a_src_value;
+				break;
+			case 2:
+				take_jump = m_src_value <= a_src_value;
+				break;
+			case 3:
+				take_jump = m_src_value == a_src_value;
+				break;
+			case 4:
+				take_jump = page_fault_flag;
+				break;
+			case 5:
+				UDEBUG(TRACE_MISC, "jump i|pf\n");
+				take_jump = page_fault_flag | (interrupt_enable_flag ? interrupt_pending_flag : 0);
+				break;
+			case 6:
+				UDEBUG(TRACE_MISC, "jump i|pf|sb\n");
+				take_jump = page_fault_flag | (interrupt_enable_flag ? interrupt_pending_flag : 0) | sequence_break_flag;
+				break;
+			case 7:
+				take_jump = 1;
+				break;
+			}
+		} else {
+			UDEBUG(TRACE_MISC, "jump-if-bit; rot %o, before %o ", d->pos, m_src_value);
+			m_src_value = rotate_left(m_src_value, d->pos);
+			UDEBUG(TRACE_MISC, "after %o\n", m_src_value);
+			take_jump = m_src_value & 1;
+		}
+
+		if (d->misc == 3) {
+			UWARNING(TRACE_MISC, "jump w/misc-3!\n");
+		}
+
+		if (d->invert_sense)
+			take_jump = !take_jump;
+
+		if (p_bit && take_jump) {
+			if (!n_bit)
+				push_spc(u_pc);
+			else
+				push_spc(u_pc - 1);
+		}
+		// P & R & jump-inst -> write ucode.
+		if (p_bit && r_bit && d->op_code == 1) {
+			ucw_t w;
+
+			w = ((ucw_t) (a_src_value & 0177777) << 32) | (uint32_t) m_src_value;
+			UDEBUG(TRACE_MISC, "u-code write; %Lo @ %o\n", w, new_pc);
+			ucode[new_pc] = w;
+			ucode_decoded[new_pc].valid = false;
+			block_invalidate(new_pc);
+
+			// An already fetched copy of the location must
+			// survive its redecode.
+			if (p1 == &ucode_decoded[new_pc]) {
+				struct udecode *h;
+
+				h = (d == &held_decoded[0]) ? &held_decoded[1] : &held_decoded[0];
+				*h = *p1;
+				p1 = h;
+			}
+		}
+		if (r_bit && take_jump) {
+			new_pc = pop_spc();
+			if ((new_pc >> 14) & 1) {
+				advance_lc(&new_pc);
+			}
+			new_pc &= 037777;
+		}
+		if (take_jump) {
+			if (n_bit)
+				no_exec_next = 1;
+			u_pc = new_pc;
+			// inhibit possible POPJ.
+			popj = 0;
+		}
+		goto done;
+
+		// DISPATCH.
+	op_dispatch:
+		pos = d->pos;
+		disp_addr = d->disp_addr;
+
+		// Misc. function 3.
+		if (d->misc == 3)
+			pos = lc_byte_pos(pos);
+
+		// Misc. function 2.
+		if (d->misc == 2) {
+			UDEBUG(TRACE_MISC, "dispatch_memory[%o] <- %o\n", disp_addr, a_src_value);
+			dispatch_memory[disp_addr] = a_src_value;
+			goto done;
+		}
+
+		UDEBUG(TRACE_MISC, "m-src %o, ", m_src_value);
+		// Rotate M-SOURCE.
+		m_src_value = rotate_left(m_src_value, pos);
+		// Generate mask.
+		mask = ~0;
+		mask >>= 31 - ((d->len - 1) & 037);
+
+		if (d->len == 0)
+			mask = 0;
+
+		// Put LDB into DISPATCH-ADDR.
+		disp_addr |= m_src_value & mask;
+
+		UDEBUG(TRACE_MISC, "rotated %o, mask %o, result %o\n", m_src_value, mask, m_src_value & mask);
+
+		// Tweak DISPATCH-ADDR with L2 map bits.
+		if (d->map) {
+			int l2_map_bits;
+			int bit18;
+			int bit19;
+
+			l2_map_bits = tlb_lookup(md)->map;
+			bit19 = ((l2_map_bits >> 19) & 1) ? 1 : 0;
+			bit18 = ((l2_map_bits >> 18) & 1) ? 1 : 0;
+			UDEBUG(TRACE_MISC, "md %o, l2_map_bits %o, b19 %o, b18 %o\n", md, l2_map_bits, bit19, bit18);
+			switch (d->map) {
+			case 1:
+				disp_addr |= bit18;
+				break;
+			case 2:
+				disp_addr |= bit19;
+				break;
+			case 3:
+				disp_addr |= bit18 | bit19;
+				break;
+			}
+		}
+		disp_addr &= 03777;
+
+		UDEBUG(TRACE_MISC, "dispatch[%o] -> %o ", disp_addr, dispatch_memory[disp_addr]);
+
+		disp_addr = dispatch_memory[disp_addr];
+		dispatch_constant = d->disp_const;
+
+		new_pc = disp_addr & 037777; // 14 bits.
+
+		n_bit = (disp_addr >> 14) & 1;
+		p_bit = (disp_addr >> 15) & 1;
+		r_bit = (disp_addr >> 16) & 1;
+
+		UDEBUG(TRACE_MISC, "%s%s%s\n", n_bit ? "N " : "", p_bit ? "P " : "", r_bit ? "R " : "");
+
+		if (d->n_plus1 && n_bit) {
+			u_pc--;
+		}
+
+		take_jump = 1;
+
+		// Enable instruction sequence hardware.
+		if (d->enable_ish) {
+			advance_lc((int *) 0);
+		}
+		// Fall through on dispatch.
+		if (p_bit && r_bit) {
+			if (n_bit)
+				no_exec_next = 1;
+			goto done;
+		}
+		d = &dispatch_jump_decoded;
+		goto process_jump;
+
+		// BYTE.
+	op_byte:
+		UDEBUG(TRACE_MISC, "a=%o (%o), m=%o (%o), dest=%o\n", d->a_src, a_src_value, d->m_src, m_src_value, d->dest);
+		pos = d->pos;
+
+		// Misc. function 3.
+		if (d->misc == 3)
+			pos = lc_byte_pos(pos);
+
+		{
+			int left_mask_index;
+			int right_mask_index;
+			uint32_t left_mask;
+			uint32_t right_mask;
+
+			if (d->mr_sr_bits & 2)
+				right_mask_index = pos;
+			else
+				right_mask_index = 0;
+
+			left_mask_index = (right_mask_index + d->widthm1) & 037;
+
+			left_mask = ~0;
+			right_mask = ~0;
+
+			left_mask >>= 31 - left_mask_index;
+			right_mask <<= right_mask_index;
+
+			mask = left_mask & right_mask;
+
+			UDEBUG(TRACE_MISC, "widthm1 %o, pos %o, mr_sr_bits %o\n", d->widthm1, pos, d->mr_sr_bits);
+			UDEBUG(TRACE_MISC, "left_mask_index %o, right_mask_index %o\n", left_mask_index, right_mask_index);
+			UDEBUG(TRACE_MISC, "left_mask %o, right_mask %o, mask %o\n", left_mask, right_mask, mask);
+		}
+
+		out_bus = 0;
+
+		switch (d->mr_sr_bits) {
+		case 0:
+			UWARNING(TRACE_MISC, "mr_sr_bits == 0!\n");
+			break;
+		case 1:	// LDB.
+			UDEBUG(TRACE_MISC, "ldb; m %o\n", m_src_value);
+			m_src_value = rotate_left(m_src_value, pos);
+			out_bus = (m_src_value & mask) | (a_src_value & ~mask);
+			UDEBUG(TRACE_MISC, "ldb; m-rot %o, mask %o, result %o\n", m_src_value, mask, out_bus);
+			break;
+		case 2:	// Selective deposit.
+			out_bus = (m_src_value & mask) | (a_src_value & ~mask);
+			UDEBUG(TRACE_MISC, "sel-dep; a %o, m %o, mask %o -> %o\n", a_src_value, m_src_value, mask, out_bus);
+			break;
+		case 3:	// DPB.
+			UDEBUG(TRACE_MISC, "dpb; m %o, pos %o\n", m_src_value, pos);
+			// Mask is already rotated.
+			m_src_value = rotate_left(m_src_value, pos);
+			out_bus = (m_src_value & mask) | (a_src_value & ~mask);
+			UDEBUG(TRACE_MISC, "dpb; mask %o, result %o\n", mask, out_bus);
+			break;
+		}
+
+		goto *dest_labels[d->dest_kind];
+
+	done:
+		if (popj) {
+			UDEBUG(TRACE_MISC, "popj; ");
+			u_pc = pop_spc();
+			if ((u_pc >> 14) & 1) {
+				advance_lc(&u_pc);
+			}
+			u_pc &= 037777;
+		}
+		if (block_end) {
+			m_src_value = 0;
+			goto block_step;
+		}
+		continue;
+
+		// Block; each instruction is known to fall through to
+		// the next, so the pipeline is only brought up to date
+		// when leaving.
+	block_step:
+		if (!run_ucode_flag)
+			block_end = block_pc;
+	block_nop:
+		if (block_pc == block_end) {
+			p0_pc = block_pc - 1;
+			p1 = fetch_decoded(block_pc);
+			p1_pc = block_pc;
+			u_pc = block_pc + 1;
+			block_end = 0;
+			if (d->nop)
+				goto next;
+			continue;
+		}
+
+		if (cycles >= sched_next)
+			ucode_sched_run(&ucode_decoded[block_pc], block_pc, block_pc + 1, 0);
+
+		cycles++;
+		if (cycles == 0)
+			cycles = 1;
+
+		d = &ucode_decoded[block_pc++];
+		if (d->nop)
+			goto block_nop;
+
+		goto execute;
+	}
+}
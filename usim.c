@@ -9,6 +9,7 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <err.h>
 
 #include "usim.h"
 #include "ucfg.h"
@@ -20,20 +21,51 @@
 #include "kbd.h"
 #include "chaos.h"
 #include "disk.h"
+#include "idle.h"
+#include "prof.h"
+#include "sched.h"
+#include "snapshot.h"
 
+#include "misc.h"
 #include "syms.h"
 #include "disass.h"
 
 static char *config_filename;
+static char *resume_filename;
+static char *delta_action;
+static bool headless_flag;
 bool warm_boot_flag = false;
 
 symtab_t sym_mcr;
 symtab_t sym_prom;
 
 static void
-sigusr1_handler(int arg)
+snapshot_event(void)
 {
 	save_state(ucfg.usim_state_filename);
+	snapshot_save(ucfg.usim_snapshot_filename);
+}
+
+static void
+sigusr1_handler(int arg)
+{
+	(void) arg;
+	sched_async(SCHED_SNAPSHOT);
+}
+
+static void
+report_event(void)
+{
+	prof_dump();
+	disk_stats_dump();
+	tv_dump();
+}
+
+static void
+sigusr2_handler(int arg)
+{
+	(void) arg;
+	sched_async(SCHED_REPORT);
 }
 
 static void
@@ -44,12 +76,17 @@ usage(void)
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -c FILE        configuration file (default: %s)\n", config_filename);
 	fprintf(stderr, "  -w             warm boot\n");
+	fprintf(stderr, "  -r FILE        resume from snapshot\n");
+	fprintf(stderr, "  -d ACTION      commit or discard the disk delta, then exit\n");
+	fprintf(stderr, "  -n             no display\n");
 	fprintf(stderr, "  -h             help message\n");
 }
 
 int
 main(int argc, char *argv[])
 {
+	char *disk_filename[DISKS_MAX];
+	char *disk_delta_filename[DISKS_MAX];
 	int c;
 
 	printf("CADR emulator v" VERSION "\n");
@@ -57,10 +94,13 @@ main(int argc, char *argv[])
 	config_filename = "usim.ini";
 	warm_boot_flag = false;
 
-	while ((c = getopt(argc, argv, "c:wh")) != -1) {
+	while ((c = getopt(argc, argv, "c:wr:d:nh")) != -1) {
 		switch (c) {
 		case 'c': config_filename = strdup(optarg); break;
 		case 'w': warm_boot_flag = true; break;
+		case 'r': resume_filename = strdup(optarg); break;
+		case 'd': delta_action = strdup(optarg); break;
+		case 'n': headless_flag = true; break;
 		case 'h':
 			usage();
 			exit(0);
@@ -82,22 +122,70 @@ main(int argc, char *argv[])
 	if (ini_parse(config_filename, ucfg_handler, &ucfg) < 0)
 		fprintf(stderr, "Can't load '%s', using defaults\n", config_filename);
 
+	if (headless_flag)
+		ucfg.tv_display = "none";
+
+#define X(n)							\
+	disk_filename[n] = ucfg.disk_disk##n##_filename;		\
+	disk_delta_filename[n] = ucfg.disk_disk##n##_delta_filename;
+	X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+#undef X
+
+	if (delta_action) {
+		if (!streq(delta_action, "commit") && !streq(delta_action, "discard"))
+			errx(1, "delta action must be commit or discard: %s", delta_action);
+		for (int i = 0; i < DISKS_MAX; i++) {
+			if (disk_filename[i] == NULL || disk_delta_filename[i] == NULL)
+				continue;
+			if (streq(delta_action, "commit"))
+				disk_commit(disk_filename[i], disk_delta_filename[i]);
+			else
+				disk_discard(disk_delta_filename[i]);
+		}
+		exit(0);
+	}
+
+	sched_handler(SCHED_SNAPSHOT, snapshot_event);
 	signal(SIGUSR1, sigusr1_handler);
+	sched_handler(SCHED_REPORT, report_event);
+	signal(SIGUSR2, sigusr2_handler);
+
+	mem_init();
+	ucode_init();
 
 	read_prom(ucfg.ucode_prommcr_filename);
 	sym_read_file(&sym_prom, ucfg.ucode_promsym_filename);
 
+	idle_init();
 	tv_init();
-	disk_init(0, ucfg.disk_disk0_filename);
+	for (int i = 0; i < DISKS_MAX; i++) {
+		if (disk_filename[i])
+			disk_init(i, disk_filename[i], disk_delta_filename[i]);
+	}
 	sym_read_file(&sym_mcr, ucfg.ucode_mcrsym_filename);
 	iob_init();
 	chaos_init();
 
-	if (warm_boot_flag == true) {
+	if (resume_filename != NULL) {
+		if (snapshot_restore(resume_filename) < 0)
+			errx(1, "can't resume from %s", resume_filename);
+	} else if (warm_boot_flag == true) {
 		kbd_warm_boot_key();
 	}
 
-	run();
+	prof_macro_init(ucfg.ucode_macro_profile_filename, ucfg.ucode_macro_trace_filename);
+
+	if (ucfg.ucode_profile_filename != NULL) {
+		if (!streq(ucfg.ucode_engine, "switch"))
+			warnx("profiling uses the switch microcode engine");
+		prof_init(ucfg.ucode_profile_filename);
+		run();
+	} else if (streq(ucfg.ucode_engine, "threaded"))
+		run_threaded();
+	else if (streq(ucfg.ucode_engine, "block"))
+		run_blocks();
+	else
+		run();
 
 	exit(0);
 }
@@ -3,13 +3,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <err.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
 #include <X11/keysym.h>
+#include <X11/extensions/XShm.h>
 
 #include "usim.h"
 #include "utrace.h"
@@ -17,6 +30,7 @@
 #include "tv.h"
 #include "kbd.h"
 #include "mouse.h"
+#include "x11.h"
 
 typedef struct DisplayState {
 	unsigned char *data;
@@ -34,6 +48,15 @@ static Visual *visual = NULL;
 static GC gc;
 static XImage *ximage;
 
+// The image data, 32 bits per pixel, expanded from the TV memory.
+// PIXELS points either to PIXELS_BUF or to a segment shared with the
+// X server.
+static uint32_t pixels_buf[768 * 1024];
+static uint32_t *pixels = pixels_buf;
+
+static bool use_shm;
+static XShmSegmentInfo shminfo;
+
 #define USIM_EVENT_MASK ExposureMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | KeyPressMask | KeyReleaseMask
 
 #define MOUSE_EVENT_LBUTTON 1
@@ -58,6 +81,73 @@ static XComposeStatus status;
 static unsigned int x_alt = X_ALT;
 static unsigned int x_meta = X_META;
 
+// Input events are passed from the display thread to the emulation
+// thread in single-producer, single-consumer rings, one for the
+// keyboard and one for the mouse.  A byte is written to the wakeup
+// pipe for each event, so the emulation thread can poll for input
+// while idle.
+#define INPUT_QUEUE_LEN 256
+
+struct input {
+	int a;			// Key code, or mouse X.
+	int b;			// Key down, or mouse Y.
+	int c;			// Mouse buttons.
+};
+
+struct input_queue {
+	struct input q[INPUT_QUEUE_LEN];
+	unsigned head;		// Next to put; only the display thread stores.
+	unsigned tail;		// Next to get; only the emulation thread stores.
+};
+
+static struct input_queue key_queue;
+static struct input_queue mouse_queue;
+static int wakeup_pipe[2] = { -1, -1 };
+
+static void
+input_put(struct input_queue *iq, int a, int b, int c)
+{
+	unsigned head;
+	char byte;
+
+	head = iq->head;
+	if (head - __atomic_load_n(&iq->tail, __ATOMIC_ACQUIRE) == INPUT_QUEUE_LEN) {
+		WARNING(TRACE_MISC, "x11: input queue full, event dropped\n");
+		return;
+	}
+
+	iq->q[head % INPUT_QUEUE_LEN].a = a;
+	iq->q[head % INPUT_QUEUE_LEN].b = b;
+	iq->q[head % INPUT_QUEUE_LEN].c = c;
+	__atomic_store_n(&iq->head, head + 1, __ATOMIC_RELEASE);
+
+	// A full pipe already wakes the reader.
+	byte = 0;
+	if (write(wakeup_pipe[1], &byte, 1) == -1) {
+		;
+	}
+}
+
+static bool
+input_get(struct input_queue *iq, struct input *in)
+{
+	unsigned tail;
+
+	tail = iq->tail;
+	if (tail == __atomic_load_n(&iq->head, __ATOMIC_ACQUIRE))
+		return false;
+
+	*in = iq->q[tail % INPUT_QUEUE_LEN];
+	__atomic_store_n(&iq->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+input_empty(struct input_queue *iq)
+{
+	return iq->tail == __atomic_load_n(&iq->head, __ATOMIC_ACQUIRE);
+}
+
 // Takes E, converts it into a LM (hardware) keycode and sends it to
 // the IOB KBD.
 static void
@@ -127,81 +217,377 @@ process_key(XEvent *e, int keydown)
 
 		lmcode |= 0xffff0000;
 
-		kbd_key_event(lmcode, keydown);
+		input_put(&key_queue, lmcode, keydown, 0);
 	}
 }
 
-static int u_minh = 0x7fffffff;
-static int u_maxh;
-static int u_minv = 0x7fffffff;
-static int u_maxv;
+// Screen updates are tracked in tiles of TILE_W by TILE_H pixels,
+// one bit per tile in DIRTY, one word per row of tiles.
+#define TILE_W 32
+#define TILE_H 16
+#define TILE_COLS (768 / TILE_W)
+#define TILE_ROWS ((1024 + TILE_H - 1) / TILE_H)
+
+// DIRTY is only used on the emulation thread.  Dirty rows of tiles
+// are copied from the TV memory to FRAME_FB, which the display thread
+// refreshes from, and marked in FRAME_DIRTY; both are guarded by
+// FRAME_LOCK.
+static uint32_t dirty[TILE_ROWS];
+static bool any_dirty;
+
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t frame_fb[TV_FB_WORDS];
+static uint32_t frame_dirty[TILE_ROWS];
+static bool frame_any_dirty;
 
 void
 accumulate_update(int h, int v, int hs, int vs)
 {
-	if (h < u_minh)
-		u_minh = h;
-	if (h + hs > u_maxh)
-		u_maxh = h + hs;
-	if (v < u_minv)
-		u_minv = v;
-	if (v + vs > u_maxv)
-		u_maxv = v + vs;
+	uint32_t mask;
+	int c0;
+	int c1;
+
+	c0 = h / TILE_W;
+	c1 = (h + hs - 1) / TILE_W;
+	if (c1 >= TILE_COLS)
+		c1 = TILE_COLS - 1;
+	mask = ((2u << (c1 - c0)) - 1) << c0;
+
+	for (int r = v / TILE_H; r <= (v + vs - 1) / TILE_H && r < TILE_ROWS; r++)
+		dirty[r] |= mask;
+	any_dirty = true;
+}
+
+// Expand N words of TV memory at SRC into pixels at DST; set bits
+// are black.
+#ifdef __SSE2__
+static void
+expand_words(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m128i black;
+	__m128i diff;
+	__m128i bit[8];
+
+	black = _mm_set1_epi32(Black);
+	diff = _mm_set1_epi32(Black ^ White);
+	for (int g = 0; g < 8; g++)
+		bit[g] = _mm_setr_epi32(1u << (4 * g), 2u << (4 * g), 4u << (4 * g), 8u << (4 * g));
+
+	for (int i = 0; i < n; i++) {
+		__m128i x;
+
+		x = _mm_set1_epi32(src[i]);
+		for (int g = 0; g < 8; g++) {
+			__m128i clear;
+
+			clear = _mm_cmpeq_epi32(_mm_and_si128(x, bit[g]), _mm_setzero_si128());
+			_mm_storeu_si128((__m128i *) (dst + 32 * i + 4 * g), _mm_xor_si128(black, _mm_and_si128(clear, diff)));
+		}
+	}
+}
+#else
+static void
+expand_words(uint32_t *dst, const uint32_t *src, int n)
+{
+	for (int i = 0; i < n; i++) {
+		uint32_t bits;
+
+		bits = src[i];
+		for (int b = 0; b < 32; b++) {
+			dst[32 * i + b] = (bits & 1) ? Black : White;
+			bits >>= 1;
+		}
+	}
+}
+#endif
+
+// Expand the TV memory behind the rectangle at H, V of size HS, VS.
+static void
+expand(int h, int v, int hs, int vs)
+{
+	int stride;
+	int w0;
+	int w1;
+
+	stride = tv_width / 32;
+	w0 = h / 32;
+	w1 = (h + hs + 31) / 32;
+	if (w1 > stride)
+		w1 = stride;
+
+	for (int y = v; y < v + vs && y < (int) tv_height; y++)
+		expand_words(&pixels[y * tv_width + w0 * 32], &frame_fb[y * stride + w0], w1 - w0);
+}
+
+static void
+put_image(int h, int v, int hs, int vs)
+{
+	if (use_shm)
+		XShmPutImage(display, window, gc, ximage, h, v, h, v, hs, vs, False);
+	else
+		XPutImage(display, window, gc, ximage, h, v, h, v, hs, vs);
+}
+
+// The server reads a shared image after XShmPutImage returns, so
+// wait for it before the pixels are expanded again.
+static void
+flush_image(void)
+{
+	if (use_shm)
+		XSync(display, False);
+	else
+		XFlush(display);
+}
+
+struct rect {
+	int c0;			// Tile columns C0 to C1-1,
+	int c1;
+	int r0;			// and tile rows R0 to R1-1.
+	int r1;
+};
+
+// Convert R to pixels, clipped to the screen.  Return false if
+// nothing is left.
+static bool
+rect_pixels(struct rect *r, int *h, int *v, int *hs, int *vs)
+{
+	*h = r->c0 * TILE_W;
+	*v = r->r0 * TILE_H;
+	*hs = r->c1 * TILE_W - *h;
+	*vs = r->r1 * TILE_H - *v;
+	if (*h + *hs > (int) tv_width)
+		*hs = tv_width - *h;
+	if (*v + *vs > (int) tv_height)
+		*vs = tv_height - *v;
+	return *hs > 0 && *vs > 0;
 }
 
+// Turn the dirty tiles in BITMAP into rectangles in RECTS, and clear
+// BITMAP: each run of dirty tiles in a row of tiles is merged with
+// the same run in the rows below.  Return the number of rectangles.
+static int
+collect_rects(uint32_t *bitmap, struct rect *rects)
+{
+	int nrects;
+
+	nrects = 0;
+	for (int row = 0; row < TILE_ROWS; row++) {
+		uint32_t bits;
+
+		bits = bitmap[row];
+		bitmap[row] = 0;
+
+		while (bits) {
+			int c0;
+			int c1;
+			int i;
+
+			c0 = __builtin_ctz(bits);
+			c1 = c0;
+			while (bits & (1u << c1))
+				c1++;
+			bits &= ~0u << c1;
+
+			for (i = 0; i < nrects; i++) {
+				if (rects[i].c0 == c0 && rects[i].c1 == c1 && rects[i].r1 == row)
+					break;
+			}
+			if (i < nrects) {
+				rects[i].r1++;
+				continue;
+			}
+
+			rects[nrects].c0 = c0;
+			rects[nrects].c1 = c1;
+			rects[nrects].r0 = row;
+			rects[nrects].r1 = row + 1;
+			nrects++;
+		}
+	}
+
+	return nrects;
+}
+
+// Copy the dirty rows of tiles from the TV memory to the frame the
+// display thread shows.  Called on the emulation thread.
 void
 send_accumulated_updates(void)
 {
+	int stride;
+
+	if (!any_dirty)
+		return;
+
+	stride = tv_width / 32;
+
+	pthread_mutex_lock(&frame_lock);
+	for (int row = 0; row < TILE_ROWS; row++) {
+		int v;
+		int vs;
+
+		if (dirty[row] == 0)
+			continue;
+
+		v = row * TILE_H;
+		vs = TILE_H;
+		if (v + vs > (int) tv_height)
+			vs = tv_height - v;
+		if (vs > 0)
+			memcpy(&frame_fb[v * stride], &tv_fb[v * stride], vs * stride * sizeof tv_fb[0]);
+
+		frame_dirty[row] |= dirty[row];
+		dirty[row] = 0;
+	}
+	frame_any_dirty = true;
+	pthread_mutex_unlock(&frame_lock);
+
+	any_dirty = false;
+}
+
+// Expand the dirty parts of the frame and put them in the window.
+// Called on the display thread.
+static void
+refresh(void)
+{
+	static struct rect rects[TILE_ROWS * TILE_COLS / 2 + 1];
+	int nrects;
+	int h;
+	int v;
 	int hs;
 	int vs;
 
-	hs = u_maxh - u_minh;
-	vs = u_maxv - u_minv;
-	if (u_minh != 0x7fffffff && u_minv != 0x7fffffff && u_maxh && u_maxv) {
-		XPutImage(display, window, gc, ximage, u_minh, u_minv, u_minh, u_minv, hs, vs);
-		XFlush(display);
+	pthread_mutex_lock(&frame_lock);
+	if (!frame_any_dirty) {
+		pthread_mutex_unlock(&frame_lock);
+		return;
 	}
+	nrects = collect_rects(frame_dirty, rects);
+	frame_any_dirty = false;
+	for (int i = 0; i < nrects; i++) {
+		if (rect_pixels(&rects[i], &h, &v, &hs, &vs))
+			expand(h, v, hs, vs);
+	}
+	pthread_mutex_unlock(&frame_lock);
 
-	u_minh = 0x7fffffff;
-	u_maxh = 0;
-	u_minv = 0x7fffffff;
-	u_maxv = 0;
+	for (int i = 0; i < nrects; i++) {
+		if (rect_pixels(&rects[i], &h, &v, &hs, &vs))
+			put_image(h, v, hs, vs);
+	}
+	flush_image();
 }
-
+
+// File descriptor that becomes readable when there is input for the
+// emulation thread, or -1 without a display.
+int
+x11_fd(void)
+{
+	return wakeup_pipe[0];
+}
+
+// True if input events are waiting for x11_event().
+bool
+x11_pending(void)
+{
+	return !input_empty(&key_queue) || !input_empty(&mouse_queue);
+}
+
+// Called on the emulation thread: hand the screen updates to the
+// display thread and deliver queued input.
 void
 x11_event(void)
 {
-	XEvent e;
+	struct input in;
+	char buf[64];
 
 	send_accumulated_updates();
-	kbd_dequeue_key_event();
 
-	while (XCheckWindowEvent(display, window, USIM_EVENT_MASK, &e)) {
-		switch (e.type) {
-		case Expose:
-			XPutImage(display, window, gc, ximage, 0, 0, 0, 0, tv_width, tv_height);
-			XFlush(display);
-			break;
-		case KeyPress:
-			process_key(&e, 1);
-			break;
-		case KeyRelease:
-			process_key(&e, 0);
-			break;
-		case MotionNotify:
-		case ButtonPress:
-		case ButtonRelease:
-			mouse_event(e.xbutton.x, e.xbutton.y, e.xbutton.button);
-			break;
-		default:
-			break;
-		}
-	}
+	// Empty the pipe before the queues, so that an event queued
+	// in between still leaves a byte behind.
+	while (read(wakeup_pipe[0], buf, sizeof buf) > 0)
+		;
+
+	while (input_get(&key_queue, &in))
+		kbd_key_event(in.a, in.b);
+	while (input_get(&mouse_queue, &in))
+		mouse_event(in.a, in.b, in.c);
 
 	if (old_run_state != run_ucode_flag)
 		old_run_state = run_ucode_flag;
 }
 
+static void
+handle_event(XEvent *e)
+{
+	switch (e->type) {
+	case Expose:
+		put_image(0, 0, tv_width, tv_height);
+		flush_image();
+		break;
+	case KeyPress:
+		process_key(e, 1);
+		break;
+	case KeyRelease:
+		process_key(e, 0);
+		break;
+	case MotionNotify:
+	case ButtonPress:
+	case ButtonRelease:
+		input_put(&mouse_queue, e->xbutton.x, e->xbutton.y, e->xbutton.button);
+		break;
+	default:
+		break;
+	}
+}
+
+#define REFRESH_NS (1000000000 / 60)
+
+// The display thread: refresh the window at a fixed rate, and read
+// input events in between.
+static void *
+x11_thread(void *arg)
+{
+	struct timespec next;
+
+	(void) arg;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		struct timespec now;
+		struct pollfd pfd;
+		long ns;
+
+		while (XPending(display)) {
+			XEvent e;
+
+			XNextEvent(display, &e);
+			handle_event(&e);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ns = (next.tv_sec - now.tv_sec) * 1000000000L + (next.tv_nsec - now.tv_nsec);
+		if (ns <= 0) {
+			refresh();
+
+			// Skip the frames that were missed, rather than
+			// catching up on them.
+			if (ns < -REFRESH_NS)
+				next = now;
+			next.tv_nsec += REFRESH_NS;
+			if (next.tv_nsec >= 1000000000L) {
+				next.tv_nsec -= 1000000000L;
+				next.tv_sec++;
+			}
+			continue;
+		}
+
+		pfd.fd = ConnectionNumber(display);
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (ns + 999999) / 1000000);
+	}
+
+	return NULL;
+}
+
 static void
 init_mod_map(void)
 {
@@ -274,6 +660,78 @@ init_mod_map(void)
 	}
 }
 
+static bool shm_error;
+
+static int
+shm_error_handler(Display *d, XErrorEvent *e)
+{
+	(void) d;
+	(void) e;
+
+	shm_error = true;
+	return 0;
+}
+
+// Set up an image in memory shared with the X server, if the server
+// supports MIT-SHM and runs on this host.  Return false to use
+// XPutImage instead.
+static bool
+shm_init(void)
+{
+	int (*old_handler)(Display *, XErrorEvent *);
+	const char *name;
+
+	if (!XShmQueryExtension(display))
+		return false;
+
+	name = DisplayString(display);
+	if (name[0] != ':' && strncmp(name, "unix:", 5) != 0)
+		return false;
+
+	ximage = XShmCreateImage(display, visual, (unsigned) color_depth, ZPixmap, NULL, &shminfo, tv_width, tv_height);
+	if (ximage == NULL)
+		return false;
+	if (ximage->bits_per_pixel != 32 || ximage->bytes_per_line != (int) tv_width * 4) {
+		XDestroyImage(ximage);
+		return false;
+	}
+
+	shminfo.shmid = shmget(IPC_PRIVATE, ximage->bytes_per_line * ximage->height, IPC_CREAT | 0600);
+	if (shminfo.shmid == -1) {
+		XDestroyImage(ximage);
+		return false;
+	}
+	shminfo.shmaddr = shmat(shminfo.shmid, NULL, 0);
+	if (shminfo.shmaddr == (char *) -1) {
+		shmctl(shminfo.shmid, IPC_RMID, NULL);
+		XDestroyImage(ximage);
+		return false;
+	}
+	shminfo.readOnly = False;
+	ximage->data = shminfo.shmaddr;
+
+	// Attaching fails with an X error, not a return value, when
+	// the server cannot reach the segment after all.
+	shm_error = false;
+	old_handler = XSetErrorHandler(shm_error_handler);
+	XShmAttach(display, &shminfo);
+	XSync(display, False);
+	XSetErrorHandler(old_handler);
+
+	// The segment goes away once both sides have detached.
+	shmctl(shminfo.shmid, IPC_RMID, NULL);
+
+	if (shm_error) {
+		shmdt(shminfo.shmaddr);
+		ximage->data = NULL;
+		XDestroyImage(ximage);
+		return false;
+	}
+
+	pixels = (uint32_t *) shminfo.shmaddr;
+	return true;
+}
+
 void
 x11_init(void)
 {
@@ -301,6 +759,7 @@ x11_init(void)
 	bitmap_order = BitmapBitOrder(display);
 	xscreen = DefaultScreen(display);
 	color_depth = DisplayPlanes(display, xscreen);
+	visual = DefaultVisual(display, xscreen);
 
 	Black = BlackPixel(display, xscreen);
 	White = WhitePixel(display, xscreen);
@@ -348,8 +807,33 @@ x11_init(void)
 	while (e.type != Expose || e.xexpose.count);
 
 	XFlush(display);
-	ximage = XCreateImage(display, visual, (unsigned) color_depth, ZPixmap, 0, (char *) tv_bitmap, tv_width, tv_height, 32, 0);
-	ximage->byte_order = LSBFirst;
+	use_shm = shm_init();
+	if (use_shm) {
+		NOTICE(TRACE_MISC, "x11: using MIT-SHM\n");
+	} else {
+		ximage = XCreateImage(display, visual, (unsigned) color_depth, ZPixmap, 0, (char *) pixels, tv_width, tv_height, 32, 0);
+		ximage->byte_order = LSBFirst;
+	}
 
 	init_mod_map();
+
+	if (pipe(wakeup_pipe) == -1)
+		err(1, "pipe");
+	for (int i = 0; i < 2; i++)
+		fcntl(wakeup_pipe[i], F_SETFL, O_NONBLOCK);
+
+	// Signals are for the emulation thread.
+	{
+		pthread_t thread;
+		sigset_t all;
+		sigset_t old;
+		int ret;
+
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		ret = pthread_create(&thread, NULL, x11_thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (ret != 0)
+			errx(1, "x11: could not start the display thread");
+	}
 }
@@ -1,8 +1,12 @@
 #ifndef USIM_X11_H
 #define USIM_X11_H
 
+#include <stdbool.h>
+
 extern void x11_init(void);
 extern void x11_event(void);
+extern int x11_fd(void);
+extern bool x11_pending(void);
 extern void accumulate_update(int h, int v, int hs, int vs);
 
 #endif